@@ -0,0 +1,348 @@
+// Ages an in-memory volume with interleaved creates, appends and deletes
+// across many directories under each allocation policy, then compares
+// free space fragmentation, how far files land from their directory and
+// what the aging cost in time and device writes.
+//
+//   make -C ../filesystem -f Makefile.linux lib
+//   g++ -O2 -std=c++17 -I../filesystem -o alloc_bench alloc_bench.cpp
+//       ../filesystem/objects.linux/libredsea.a -lpthread
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "bitmap.h"
+#include "redsea.h"
+
+
+#define BITMAP_SECTORS	64
+#define DATA_SECTORS	(BITMAP_SECTORS * 0x200 * 8)
+#define FIRST_SECTOR	(BITMAP_SECTORS + 1)
+#define ROOT_SECTORS	8
+#define DIRECTORIES		48
+#define DIRECTORY_SLOTS	512
+
+
+class MemoryDevice : public RedSeaDevice {
+public:
+						MemoryDevice(uint64_t size)
+							: mData(size), mWritten(0) {}
+	uint8_t *			Data() { return mData.data(); }
+	uint64_t			Written() const { return mWritten; }
+
+	virtual ssize_t		ReadAt(uint64_t location, void *buffer, size_t count)
+	{
+		if (location >= mData.size())
+			return 0;
+		if (location + count > mData.size())
+			count = mData.size() - location;
+		memcpy(buffer, &mData[location], count);
+		return count;
+	}
+
+	virtual ssize_t		WriteAt(uint64_t location, const void *buffer,
+							size_t count)
+	{
+		if (location + count > mData.size())
+			return -1;
+		memcpy(&mData[location], buffer, count);
+		mWritten += count;
+		return count;
+	}
+
+	virtual ssize_t		ReadVecAt(uint64_t location, const struct iovec *vecs,
+							int count)
+	{
+		ssize_t total = 0;
+		for (int i = 0; i < count; i++) {
+			ssize_t done = ReadAt(location + total, vecs[i].iov_base,
+				vecs[i].iov_len);
+			if (done < 0)
+				return done;
+			total += done;
+		}
+		return total;
+	}
+
+	virtual ssize_t		WriteVecAt(uint64_t location, const struct iovec *vecs,
+							int count)
+	{
+		ssize_t total = 0;
+		for (int i = 0; i < count; i++) {
+			ssize_t done = WriteAt(location + total, vecs[i].iov_base,
+				vecs[i].iov_len);
+			if (done < 0)
+				return done;
+			total += done;
+		}
+		return total;
+	}
+
+private:
+	std::vector<uint8_t> mData;
+	uint64_t			mWritten;
+};
+
+
+struct BenchFile {
+	int					mDirectory;
+	char				mName[16];
+	uint64_t			mSize;
+};
+
+
+struct Result {
+	double				mSeconds;
+	uint64_t			mWritten;
+	uint64_t			mFreeRuns;
+	uint64_t			mLargestFree;
+	double				mDistance;
+	double				mScanGap;
+};
+
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Boot sector, an empty bitmap and a root directory right behind it.
+static MemoryDevice *
+format()
+{
+	MemoryDevice *device = new MemoryDevice(
+		(uint64_t)(FIRST_SECTOR + DATA_SECTORS) * 0x200);
+	uint8_t *data = device->Data();
+
+	RSBoot boot;
+	memset(&boot, 0, sizeof(boot));
+	boot.signature = 0x88;
+	boot.signature2 = 0xAA55;
+	boot.count = FIRST_SECTOR + DATA_SECTORS;
+	boot.root_sector = FIRST_SECTOR;
+	boot.bitmap_sectors = BITMAP_SECTORS;
+	memcpy(data, &boot, sizeof(boot));
+
+	bitmap_set_range(data + 0x200, 0, ROOT_SECTORS);
+
+	RSDirEntry root = {};
+	root.mAttributes = RS_ATTR_DIR | RS_ATTR_CONTIGUOUS;
+	strcpy(root.mName, ".");
+	root.mCluster = FIRST_SECTOR;
+	root.mSize = ROOT_SECTORS * 0x200;
+	memcpy(data + FIRST_SECTOR * 0x200, &root, sizeof(root));
+	return device;
+}
+
+
+// Mostly small files with a long tail, 2 KiB to 1 MiB.
+static uint64_t
+random_size()
+{
+	uint64_t size = 2048 << (rand() % 6);
+	if (rand() % 8 == 0)
+		size <<= 3;
+	return size + rand() % size;
+}
+
+
+static bool
+create_file(RedSea *volume, RedSeaDirectory *directory, BenchFile &file,
+	const uint8_t *pattern)
+{
+	RSEntryPointer pointer = directory->CreateFile(file.mName, file.mSize);
+	if (pointer.mLocation == gInvalidPointer.mLocation)
+		return false;
+
+	RedSeaFile *entry = (RedSeaFile *)volume->Create(pointer);
+	entry->Write(0, file.mSize, pattern);
+	delete entry;
+	return true;
+}
+
+
+static bool
+append_file(RedSea *volume, RedSeaDirectory *directory, BenchFile &file,
+	const uint8_t *pattern)
+{
+	RedSeaFile *entry = (RedSeaFile *)volume->Create(
+		directory->Lookup(file.mName));
+	uint64_t added = 4096 + rand() % 65536;
+	bool success = entry->Resize(file.mSize + added);
+	if (success) {
+		entry->Flush();
+		entry->Write(file.mSize, added, pattern);
+		file.mSize += added;
+	}
+	delete entry;
+	return success;
+}
+
+
+static void
+delete_file(RedSea *volume, RedSeaDirectory *directory, BenchFile &file)
+{
+	RedSeaDirEntry *entry = volume->Create(directory->Lookup(file.mName));
+	entry->Delete();
+	entry->Flush();
+	delete entry;
+}
+
+
+static void
+measure(MemoryDevice *device, RedSeaDirectory **directories, int count,
+	Result &result)
+{
+	const uint8_t *map = device->Data() + 0x200;
+	uint64_t position = 0;
+	result.mFreeRuns = 0;
+	result.mLargestFree = 0;
+	while (position < DATA_SECTORS) {
+		uint64_t start = bitmap_find_clear_run(map, DATA_SECTORS, position, 1);
+		if (start == BITMAP_NOT_FOUND)
+			break;
+		uint64_t end = bitmap_find_set(map, DATA_SECTORS, start);
+		result.mFreeRuns++;
+		if (end - start > result.mLargestFree)
+			result.mLargestFree = end - start;
+		position = end;
+	}
+
+	// distance of each file from the end of its directory's table, and the
+	// gaps a reader copying one directory after the other has to seek over
+	uint64_t files = 0;
+	double distance = 0;
+	double gaps = 0;
+	uint64_t previousEnd = 0;
+	for (int i = 0; i < count; i++) {
+		RedSeaDirectory *directory = directories[i];
+		const RSDirEntry &self = directory->DirEntry();
+		uint64_t tableEnd = self.mCluster + (self.mSize + 0x1FF) / 0x200;
+		int slot = 0;
+		RSDirEntry entry;
+		for (;;) {
+			RSEntryPointer pointer = directory->NextEntry(&slot);
+			if (pointer.mLocation == gInvalidPointer.mLocation)
+				break;
+			if (!directory->EntryAt(pointer.mLocation, &entry))
+				continue;
+			if (entry.mAttributes & RS_ATTR_DIR)
+				continue;
+
+			distance += entry.mCluster > tableEnd
+				? entry.mCluster - tableEnd : tableEnd - entry.mCluster;
+			if (previousEnd != 0) {
+				gaps += entry.mCluster > previousEnd
+					? entry.mCluster - previousEnd
+					: previousEnd - entry.mCluster;
+			}
+			previousEnd = entry.mCluster + (entry.mSize + 0x1FF) / 0x200;
+			files++;
+		}
+	}
+	result.mDistance = files > 0 ? distance / files : 0;
+	result.mScanGap = files > 0 ? gaps / files : 0;
+}
+
+
+static void
+run(int policy, int operations, Result &result)
+{
+	srand(7);
+	MemoryDevice *device = format();
+	RedSea *volume = new RedSea(device);
+	volume->SetAllocationPolicy(policy);
+
+	RedSeaDirectory *root = (RedSeaDirectory *)volume->Create(
+		volume->RootDirectory());
+	RedSeaDirectory *directories[DIRECTORIES];
+	int created = 0;
+
+	std::vector<uint8_t> pattern(8 << 20, 0x5A);
+	std::vector<BenchFile> files;
+	std::vector<int> counts(DIRECTORIES, 0);
+	uint64_t serial = 0;
+	uint64_t target = DATA_SECTORS * 7 / 10;
+	uint64_t base = device->Written();
+
+	double start = now();
+	for (int i = 0; i < operations; i++) {
+		// the tree grows along with the files in it
+		if (created < DIRECTORIES
+			&& (int64_t)i * DIRECTORIES >= (int64_t)operations * created) {
+			char name[16];
+			snprintf(name, sizeof(name), "d%d", created);
+			directories[created++] = (RedSeaDirectory *)volume->Create(
+				root->CreateDirectory(name, DIRECTORY_SLOTS));
+		}
+
+		int choice = rand() % 10;
+		bool full = volume->UsedClusters() > target;
+		if (!files.empty() && (full || choice < 3)) {
+			size_t index = rand() % files.size();
+			BenchFile &file = files[index];
+			delete_file(volume, directories[file.mDirectory], file);
+			counts[file.mDirectory]--;
+			files[index] = files.back();
+			files.pop_back();
+		} else if (!files.empty() && choice < 5) {
+			BenchFile &file = files[rand() % files.size()];
+			append_file(volume, directories[file.mDirectory], file,
+				pattern.data());
+		} else {
+			BenchFile file;
+			file.mDirectory = rand() % created;
+			if (counts[file.mDirectory] >= DIRECTORY_SLOTS - 2)
+				continue;
+			snprintf(file.mName, sizeof(file.mName), "f%llu",
+				(unsigned long long)serial++);
+			file.mSize = random_size();
+			if (create_file(volume, directories[file.mDirectory], file,
+					pattern.data())) {
+				files.push_back(file);
+				counts[file.mDirectory]++;
+			}
+		}
+		volume->FlushBitmap();
+	}
+	volume->Sync();
+	result.mSeconds = now() - start;
+	result.mWritten = device->Written() - base;
+
+	measure(device, directories, created, result);
+
+	for (int i = 0; i < created; i++)
+		delete directories[i];
+	delete root;
+	delete volume; // and the device with it
+}
+
+
+int
+main(int argc, char **argv)
+{
+	int operations = argc > 1 ? atoi(argv[1]) : 100000;
+	static const char *kPolicies[] = { "first", "best", "next", "near" };
+
+	printf("%d operations on a %d MiB volume, %d directories\n\n",
+		operations, DATA_SECTORS / 2048, DIRECTORIES);
+	printf("%-8s %9s %10s %10s %12s %12s %12s\n", "policy", "ops/s",
+		"MiB writ.", "free runs", "largest MiB", "to dir KiB", "scan gap KiB");
+	for (int i = 0; i < (int)(sizeof(kPolicies) / sizeof(kPolicies[0])); i++) {
+		Result result;
+		run(RedSea::AllocationPolicyFor(kPolicies[i]), operations, result);
+		printf("%-8s %9.0f %10.1f %10llu %12.1f %12.1f %12.1f\n", kPolicies[i],
+			operations / result.mSeconds, result.mWritten / 1048576.0,
+			(unsigned long long)result.mFreeRuns, result.mLargestFree / 2048.0,
+			result.mDistance / 2.0, result.mScanGap / 2.0);
+	}
+	return 0;
+}
@@ -0,0 +1,328 @@
+// Relocates files of sizes around the cache block and copy chunk sizes on
+// a regular-file image, where whole blocks are copied by the kernel and the
+// edges through the cache. Files are moved down by the compactor and up by
+// growing them, to aligned and unaligned targets. Checks that the files and
+// their neighbours read back intact from the image and that the image kept
+// its size.
+//
+//   make -C ../filesystem -f Makefile.linux check
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "bitmap.h"
+#include "compactor.h"
+#include "redsea.h"
+
+
+#define BITMAP_SECTORS	4
+#define DATA_SECTORS	(BITMAP_SECTORS * 0x200 * 8)
+#define FIRST_SECTOR	(BITMAP_SECTORS + 1)
+#define ROOT_SECTORS	8
+#define IMAGE_SIZE		((uint64_t)(FIRST_SECTOR + DATA_SECTORS) * 0x200)
+#define BLOCK_SIZE		4096
+#define CHUNK_SIZE		(1 << 20)
+
+
+struct TestFile {
+	const char *		mName;
+	uint64_t			mSize;
+	int					mSeed;
+};
+
+
+static inline uint64_t
+sectors_for_size(uint64_t size)
+{
+	return size == 0 ? 1 : (size + 0x1FF) / 0x200;
+}
+
+
+static inline uint8_t
+pattern_byte(int seed, uint64_t offset)
+{
+	return (uint8_t)(offset * 7 + offset / 0x200 + seed * 31);
+}
+
+
+// Boot sector, an empty bitmap and a root directory right behind it, in
+// a sparse image file.
+static bool
+format(int fd)
+{
+	std::vector<uint8_t> data((FIRST_SECTOR + ROOT_SECTORS) * 0x200);
+
+	RSBoot boot;
+	memset(&boot, 0, sizeof(boot));
+	boot.signature = 0x88;
+	boot.signature2 = 0xAA55;
+	boot.count = FIRST_SECTOR + DATA_SECTORS;
+	boot.root_sector = FIRST_SECTOR;
+	boot.bitmap_sectors = BITMAP_SECTORS;
+	memcpy(data.data(), &boot, sizeof(boot));
+
+	bitmap_set_range(data.data() + 0x200, 0, ROOT_SECTORS);
+
+	RSDirEntry root = {};
+	root.mAttributes = RS_ATTR_DIR | RS_ATTR_CONTIGUOUS;
+	strcpy(root.mName, ".");
+	root.mCluster = FIRST_SECTOR;
+	root.mSize = ROOT_SECTORS * 0x200;
+	memcpy(data.data() + FIRST_SECTOR * 0x200, &root, sizeof(root));
+
+	return pwrite(fd, data.data(), data.size(), 0) == (ssize_t)data.size()
+		&& ftruncate(fd, IMAGE_SIZE) == 0;
+}
+
+
+static bool
+create_file(RedSea *volume, RedSeaDirectory *root, const TestFile &file)
+{
+	RSEntryPointer pointer = root->CreateFile(file.mName, file.mSize);
+	if (pointer.mLocation == gInvalidPointer.mLocation)
+		return false;
+
+	std::vector<uint8_t> data(file.mSize);
+	for (uint64_t i = 0; i < file.mSize; i++)
+		data[i] = pattern_byte(file.mSeed, i);
+
+	RedSeaFile *entry = (RedSeaFile *)volume->Create(pointer);
+	bool success = entry->Write(0, file.mSize, data.data()) == file.mSize;
+	delete entry;
+	return success;
+}
+
+
+// Returns the first sector of the file, or UINT64_MAX if it does not read
+// back as written.
+static uint64_t
+check_file(RedSea *volume, RedSeaDirectory *root, const TestFile &file)
+{
+	RSEntryPointer pointer = root->Lookup(file.mName);
+	if (pointer.mLocation == gInvalidPointer.mLocation)
+		return UINT64_MAX;
+
+	RedSeaFile *entry = (RedSeaFile *)volume->Create(pointer);
+	uint64_t sector = entry->DirEntry().mCluster;
+	std::vector<uint8_t> data(file.mSize);
+	if (entry->DirEntry().mSize != file.mSize
+		|| entry->Read(0, file.mSize, data.data()) != file.mSize) {
+		sector = UINT64_MAX;
+	}
+	for (uint64_t i = 0; sector != UINT64_MAX && i < file.mSize; i++) {
+		if (data[i] != pattern_byte(file.mSeed, i))
+			sector = UINT64_MAX;
+	}
+	delete entry;
+	return sector;
+}
+
+
+static RedSea *
+create_volume(const char *path)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || !format(fd)) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	return new RedSea(fd);
+}
+
+
+// Reopens the image and checks that every file is where it is expected and
+// reads back intact, that nothing else is allocated, and that the image
+// did not grow.
+static bool
+check_volume(const char *path, const TestFile *files, const uint64_t *sectors,
+	int count)
+{
+	struct stat st;
+	int fd = open(path, O_RDWR);
+	if (fd < 0 || fstat(fd, &st) != 0 || (uint64_t)st.st_size != IMAGE_SIZE) {
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	RedSea *volume = new RedSea(fd);
+	RedSeaDirectory *root = (RedSeaDirectory *)volume->Create(
+		volume->RootDirectory());
+	bool success = true;
+	uint64_t used = FIRST_SECTOR + ROOT_SECTORS;
+	for (int i = 0; i < count; i++) {
+		if (check_file(volume, root, files[i]) != sectors[i])
+			success = false;
+		used += sectors_for_size(files[i].mSize);
+	}
+	if (volume->UsedClusters() != used)
+		success = false;
+	delete root;
+	delete volume;
+	return success;
+}
+
+
+static void
+report(bool success, const char *how, uint64_t size, uint64_t to)
+{
+	printf("%-4s %-5s %8llu bytes to sector %5llu (block offset %4llu)\n",
+		success ? "ok" : "FAIL", how, (unsigned long long)size,
+		(unsigned long long)to, (unsigned long long)(to * 0x200 % BLOCK_SIZE));
+}
+
+
+// Lays out a pad, a gap and the file with a small neighbour behind it,
+// frees the gap and lets the compactor move the file down to the end of
+// the pad. A gap as large as the file makes that a move to a disjoint run,
+// a smaller one a move up and from there down into the grown gap.
+static bool
+compact(const char *path, uint64_t padSectors, uint64_t gapSectors,
+	uint64_t size)
+{
+	TestFile files[] = {
+		{ "pad", padSectors * 0x200 - 100, 1 },
+		{ "file", size, 3 },
+		{ "neighbour", 3 * 0x200 + 17, 4 }
+	};
+	TestFile gap = { "gap", gapSectors * 0x200, 2 };
+
+	RedSea *volume = create_volume(path);
+	if (volume == NULL)
+		return false;
+	RedSeaDirectory *root = (RedSeaDirectory *)volume->Create(
+		volume->RootDirectory());
+	bool success = create_file(volume, root, files[0])
+		&& create_file(volume, root, gap)
+		&& create_file(volume, root, files[1])
+		&& create_file(volume, root, files[2]);
+	if (success) {
+		RedSeaDirEntry *entry = volume->Create(root->Lookup(gap.mName));
+		entry->Delete();
+		entry->Flush();
+		delete entry;
+		success = volume->Sync();
+	}
+	delete root;
+
+	if (success) {
+		RedSeaCompactor compactor(volume);
+		success = compactor.Run() && compactor.IsDone();
+	}
+	delete volume; // and the image with it
+
+	uint64_t to = FIRST_SECTOR + ROOT_SECTORS + padSectors;
+	uint64_t sectors[] = { FIRST_SECTOR + ROOT_SECTORS, to,
+		to + sectors_for_size(size) };
+	success = check_volume(path, files, sectors, 3) && success;
+	report(success, gapSectors < sectors_for_size(size) ? "stage" : "move",
+		size, to);
+	return success;
+}
+
+
+// Lays out the file with a neighbour right behind it and grows the file by
+// a sector, which moves it up behind the neighbour.
+static bool
+grow(const char *path, uint64_t neighbourSectors, uint64_t size)
+{
+	TestFile files[] = {
+		{ "file", size, 3 },
+		{ "neighbour", neighbourSectors * 0x200 - 200, 4 }
+	};
+
+	RedSea *volume = create_volume(path);
+	if (volume == NULL)
+		return false;
+	volume->SetAllocationPolicy(RS_ALLOCATE_FIRST_FIT);
+	RedSeaDirectory *root = (RedSeaDirectory *)volume->Create(
+		volume->RootDirectory());
+	bool success = create_file(volume, root, files[0])
+		&& create_file(volume, root, files[1])
+		&& volume->Sync();
+	if (success) {
+		// the new tail keeps the pattern going
+		std::vector<uint8_t> tail(0x200);
+		for (uint64_t i = 0; i < tail.size(); i++)
+			tail[i] = pattern_byte(files[0].mSeed, size + i);
+
+		RedSeaFile *entry = (RedSeaFile *)volume->Create(
+			root->Lookup(files[0].mName));
+		success = entry->Resize(size + tail.size())
+			&& entry->Write(size, tail.size(), tail.data()) == tail.size();
+		entry->TrimReservation();
+		entry->Flush();
+		delete entry;
+		files[0].mSize += tail.size();
+	}
+	delete root;
+	delete volume;
+
+	uint64_t from = FIRST_SECTOR + ROOT_SECTORS;
+	uint64_t to = from + sectors_for_size(size) + neighbourSectors;
+	uint64_t sectors[] = { to, from + sectors_for_size(size) };
+	success = check_volume(path, files, sectors, 2) && success;
+	report(success, "grow", size, to);
+	return success;
+}
+
+
+int
+main()
+{
+	char path[] = "/tmp/copy_test.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	// a copy running past its end must not fill the disk
+	struct rlimit limit = { 2 * IMAGE_SIZE, 2 * IMAGE_SIZE };
+	signal(SIGXFSZ, SIG_IGN);
+	setrlimit(RLIMIT_FSIZE, &limit);
+
+	static const uint64_t kSizes[] = {
+		100, BLOCK_SIZE - 1, BLOCK_SIZE, BLOCK_SIZE + 1, 3 * BLOCK_SIZE + 100,
+		CHUNK_SIZE - 1, CHUNK_SIZE, CHUNK_SIZE + 1,
+		CHUNK_SIZE + BLOCK_SIZE + 100
+	};
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(kSizes) / sizeof(kSizes[0]); i++) {
+		uint64_t sectors = sectors_for_size(kSizes[i]);
+		// pads and neighbours of every length up to a block put the target
+		// at every sector offset inside one
+		for (uint64_t pad = 1; pad <= BLOCK_SIZE / 0x200; pad++) {
+			if (!compact(path, pad, sectors, kSizes[i]))
+				failed++;
+			if (sectors > 1 && !compact(path, pad, (sectors + 1) / 2,
+					kSizes[i])) {
+				failed++;
+			}
+			if (!grow(path, pad, kSizes[i]))
+				failed++;
+			// far enough for the kernel to copy whole chunks
+			if (!grow(path, pad + 2 * CHUNK_SIZE / 0x200, kSizes[i]))
+				failed++;
+		}
+	}
+
+	unlink(path);
+	if (failed > 0) {
+		printf("%d failed\n", failed);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,210 @@
+#include "bitmap.h"
+
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+static inline uint64_t
+load_word(const uint8_t *map, uint64_t word, uint64_t bits)
+{
+	uint64_t value = 0;
+	uint64_t bytes = (bits + 7) / 8 - word * 8;
+	memcpy(&value, map + word * 8, bytes < 8 ? bytes : 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap64(value);
+#endif
+
+	// everything past the end of the map counts as allocated
+	uint64_t valid = bits - word * 64;
+	if (valid < 64)
+		value |= ~(uint64_t)0 << valid;
+	return value;
+}
+
+
+// Returns the index of the first 64-bit word at or after "word" that is not
+// completely allocated, only looking at whole words below "words".
+static inline uint64_t
+skip_full_words(const uint8_t *map, uint64_t word, uint64_t words)
+{
+#if defined(__AVX2__)
+	const __m256i ones = _mm256_set1_epi8(-1);
+	for (; word + 4 <= words; word += 4) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)(map + word * 8));
+		if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, ones))
+				!= 0xFFFFFFFF) {
+			break;
+		}
+	}
+#elif defined(__SSE2__)
+	const __m128i ones = _mm_set1_epi8(-1);
+	for (; word + 2 <= words; word += 2) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(map + word * 8));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, ones)) != 0xFFFF)
+			break;
+	}
+#endif
+	for (; word < words; word++) {
+		uint64_t value;
+		memcpy(&value, map + word * 8, 8);
+		if (value != ~(uint64_t)0)
+			break;
+	}
+	return word;
+}
+
+
+uint64_t
+bitmap_find_clear_run(const uint8_t *map, uint64_t bits, uint64_t start,
+	uint64_t count)
+{
+	if (count == 0)
+		count = 1;
+	if (start >= bits || count > bits - start)
+		return BITMAP_NOT_FOUND;
+
+	uint64_t words = (bits + 63) / 64;
+	uint64_t fullWords = bits / 64;
+	uint64_t runStart = 0;
+	uint64_t runLength = 0;
+
+	for (uint64_t word = start / 64; word < words; word++) {
+		if (runLength == 0) {
+			word = skip_full_words(map, word, fullWords);
+			if (word >= words)
+				break;
+		}
+
+		uint64_t base = word * 64;
+		// free bits are set in "free"
+		uint64_t free = ~load_word(map, word, bits);
+		if (base < start)
+			free &= ~(uint64_t)0 << (start - base);
+
+		if (runLength > 0) {
+			// extend the run that reached the end of the previous word
+			uint64_t length = free == ~(uint64_t)0 ? 64 : __builtin_ctzll(~free);
+			runLength += length;
+			if (runLength >= count)
+				return runStart;
+			if (length == 64)
+				continue;
+			runLength = 0;
+			free &= ~(uint64_t)0 << length;
+		}
+
+		while (free != 0) {
+			uint64_t first = __builtin_ctzll(free);
+			uint64_t rest = ~(free >> first);
+			uint64_t length = rest == 0 ? 64 - first : __builtin_ctzll(rest);
+			if (length >= count)
+				return base + first;
+			if (first + length == 64) {
+				runStart = base + first;
+				runLength = length;
+				break;
+			}
+			free &= ~(((((uint64_t)1) << length) - 1) << first);
+		}
+	}
+
+	return BITMAP_NOT_FOUND;
+}
+
+
+// Returns the first allocated bit at or after "start", or "bits" if there
+// is none.
+uint64_t
+bitmap_find_set(const uint8_t *map, uint64_t bits, uint64_t start)
+{
+	if (start >= bits)
+		return bits;
+
+	uint64_t words = (bits + 63) / 64;
+	for (uint64_t word = start / 64; word < words; word++) {
+		uint64_t value = load_word(map, word, bits);
+		if (word * 64 < start)
+			value &= ~(uint64_t)0 << (start - word * 64);
+		if (value != 0) {
+			uint64_t bit = word * 64 + __builtin_ctzll(value);
+			return bit < bits ? bit : bits;
+		}
+	}
+	return bits;
+}
+
+
+bool
+bitmap_is_clear(const uint8_t *map, uint64_t start, uint64_t count)
+{
+	uint64_t end = start + count;
+	while (start < end && (start % 8) != 0) {
+		if (map[start / 8] & (1 << (start % 8)))
+			return false;
+		start++;
+	}
+	for (; start + 64 <= end; start += 64) {
+		uint64_t value;
+		memcpy(&value, map + start / 8, 8);
+		if (value != 0)
+			return false;
+	}
+	for (; start < end; start++) {
+		if (map[start / 8] & (1 << (start % 8)))
+			return false;
+	}
+	return true;
+}
+
+
+static inline uint8_t
+byte_mask(uint64_t from, uint64_t to)
+{
+	// bits [from, to) of a single byte, 0 <= from < to <= 8
+	return (uint8_t)((0xFF << from) & (0xFF >> (8 - to)));
+}
+
+
+void
+bitmap_set_range(uint8_t *map, uint64_t start, uint64_t count)
+{
+	if (count == 0)
+		return;
+
+	uint64_t end = start + count;
+	uint64_t first = start / 8;
+	uint64_t last = (end - 1) / 8;
+
+	if (first == last) {
+		map[first] |= byte_mask(start % 8, (end - 1) % 8 + 1);
+		return;
+	}
+
+	map[first] |= byte_mask(start % 8, 8);
+	memset(map + first + 1, 0xFF, last - first - 1);
+	map[last] |= byte_mask(0, (end - 1) % 8 + 1);
+}
+
+
+void
+bitmap_clear_range(uint8_t *map, uint64_t start, uint64_t count)
+{
+	if (count == 0)
+		return;
+
+	uint64_t end = start + count;
+	uint64_t first = start / 8;
+	uint64_t last = (end - 1) / 8;
+
+	if (first == last) {
+		map[first] &= ~byte_mask(start % 8, (end - 1) % 8 + 1);
+		return;
+	}
+
+	map[first] &= ~byte_mask(start % 8, 8);
+	memset(map + first + 1, 0x00, last - first - 1);
+	map[last] &= ~byte_mask(0, (end - 1) % 8 + 1);
+}
@@ -0,0 +1,19 @@
+#ifndef REDSEA_BITMAP_H
+#define REDSEA_BITMAP_H
+
+#include <stdint.h>
+
+// Helpers for the RedSea allocation bitmap. Bit i lives in bit (i % 8) of
+// byte (i / 8); a set bit marks an allocated sector. All lengths are in
+// bits; bits beyond "bits" are never reported as free.
+
+#define BITMAP_NOT_FOUND	UINT64_MAX
+
+uint64_t	bitmap_find_clear_run(const uint8_t *map, uint64_t bits,
+				uint64_t start, uint64_t count);
+uint64_t	bitmap_find_set(const uint8_t *map, uint64_t bits, uint64_t start);
+bool		bitmap_is_clear(const uint8_t *map, uint64_t start, uint64_t count);
+void		bitmap_set_range(uint8_t *map, uint64_t start, uint64_t count);
+void		bitmap_clear_range(uint8_t *map, uint64_t start, uint64_t count);
+
+#endif
@@ -0,0 +1,648 @@
+#include "blockcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "redsea.h"
+
+// Longest run of missing blocks fetched with a single vectored read.
+#define RS_CACHE_MAX_RUN	64
+// Prefetches queued beyond this many replace the oldest one.
+#define RS_PREFETCH_QUEUE	8
+
+
+RedSeaBlockCache::RedSeaBlockCache(RedSea *volume, uint64_t deviceSize,
+	uint64_t budget, uint32_t blockSize)
+	:
+	mVolume(volume),
+	mDeviceSize(deviceSize),
+	mBlockSize(blockSize),
+	mHead(NULL),
+	mTail(NULL),
+	mQuitting(false)
+{
+	mMaxBlocks = budget / blockSize;
+	if (mMaxBlocks == 0)
+		mMaxBlocks = 1;
+}
+
+
+RedSeaBlockCache::~RedSeaBlockCache()
+{
+	mLocker.lock();
+	mQuitting = true;
+	mLocker.unlock();
+	mPrefetchCondition.notify_all();
+	if (mPrefetcher.joinable())
+		mPrefetcher.join();
+
+	while (mHead != NULL) {
+		RedSeaCacheBlock *block = mHead;
+		_Unlink(block);
+		_Free(block);
+	}
+}
+
+
+void
+RedSeaBlockCache::SetBudget(uint64_t budget)
+{
+	mLocker.lock();
+	mMaxBlocks = budget / mBlockSize;
+	if (mMaxBlocks == 0)
+		mMaxBlocks = 1;
+	_Shrink(mMaxBlocks);
+	mLocker.unlock();
+}
+
+
+static inline void
+copy_out(RedSeaCacheBlock *block, uint32_t blockSize, uint64_t location,
+	uint64_t end, uint8_t *buffer)
+{
+	// prefetches only load the blocks
+	if (buffer == NULL)
+		return;
+
+	uint64_t from = std::max(block->mLocation, location);
+	uint64_t to = std::min(block->mLocation + blockSize, end);
+	memcpy(buffer + (from - location), block->mData + (from - block->mLocation),
+		to - from);
+}
+
+
+static inline void
+copy_in(RedSeaCacheBlock *block, uint32_t blockSize, uint64_t location,
+	uint64_t end, const uint8_t *buffer)
+{
+	uint64_t from = std::max(block->mLocation, location);
+	uint64_t to = std::min(block->mLocation + blockSize, end);
+	memcpy(block->mData + (from - block->mLocation), buffer + (from - location),
+		to - from);
+}
+
+
+uint64_t
+RedSeaBlockCache::Read(uint64_t location, uint64_t count, void *buffer)
+{
+	uint8_t *data = (uint8_t *)buffer;
+	uint64_t end = location + count;
+	uint64_t block = location - location % mBlockSize;
+
+	mLocker.lock();
+	while (block < end) {
+		RedSeaCacheBlock *cached = _Lookup(block);
+		if (cached != NULL && cached->mFilling) {
+			mIdleCondition.wait(mLocker);
+			continue;
+		}
+		if (cached != NULL) {
+			_Touch(cached);
+			copy_out(cached, mBlockSize, location, end, data);
+			block += mBlockSize;
+			continue;
+		}
+
+		// Fetch the whole run of missing blocks without holding the lock.
+		// The blocks are in place meanwhile, marked as being filled, so
+		// that nobody else reads or changes them before they are.
+		int runLength = 1;
+		while (runLength < RS_CACHE_MAX_RUN
+			&& block + runLength * mBlockSize < end
+			&& _Lookup(block + runLength * mBlockSize) == NULL) {
+			runLength++;
+		}
+
+		RedSeaCacheBlock *run[RS_CACHE_MAX_RUN];
+		struct iovec vecs[RS_CACHE_MAX_RUN];
+		for (int i = 0; i < runLength; i++) {
+			run[i] = _Allocate(block + i * mBlockSize);
+			run[i]->mFilling = true;
+			_Insert(run[i]);
+			vecs[i].iov_base = run[i]->mData;
+			vecs[i].iov_len = mBlockSize;
+		}
+		mLocker.unlock();
+
+		int filled = runLength;
+		ssize_t bytes = mVolume->mDevice->ReadVecAt(block, vecs, runLength);
+		if (bytes != (ssize_t)runLength * mBlockSize) {
+			for (filled = 0; filled < runLength; filled++) {
+				if (!_Fill(run[filled]))
+					break;
+			}
+		}
+
+		mLocker.lock();
+		for (int i = 0; i < runLength; i++) {
+			run[i]->mFilling = false;
+			if (i < filled)
+				copy_out(run[i], mBlockSize, location, end, data);
+			else
+				_Remove(run[i]);
+		}
+		mIdleCondition.notify_all();
+
+		block += filled * mBlockSize;
+		if (filled < runLength) {
+			mLocker.unlock();
+			return block > location ? block - location : 0;
+		}
+		if (mBlocks.size() > mMaxBlocks)
+			_Shrink(mMaxBlocks);
+	}
+	mLocker.unlock();
+	return count;
+}
+
+
+uint64_t
+RedSeaBlockCache::Write(uint64_t location, uint64_t count, const void *buffer)
+{
+	const uint8_t *data = (const uint8_t *)buffer;
+	uint64_t end = location + count;
+	uint64_t block = location - location % mBlockSize;
+
+	mLocker.lock();
+	while (block < end) {
+		RedSeaCacheBlock *cached = _Lookup(block);
+		if (cached != NULL && _IsBusy(cached)) {
+			mIdleCondition.wait(mLocker);
+			continue;
+		}
+
+		if (cached == NULL) {
+			cached = _Allocate(block);
+			bool partial = block < location || block + mBlockSize > end;
+			if (partial) {
+				// the rest of the block is read without holding the lock
+				cached->mFilling = true;
+				_Insert(cached);
+				mLocker.unlock();
+				bool filled = _Fill(cached);
+				mLocker.lock();
+				cached->mFilling = false;
+				mIdleCondition.notify_all();
+				if (!filled) {
+					_Remove(cached);
+					mLocker.unlock();
+					return block > location ? block - location : 0;
+				}
+			} else
+				_Insert(cached);
+		} else
+			_Touch(cached);
+
+		copy_in(cached, mBlockSize, location, end, data);
+		cached->mDirty = true;
+		block += mBlockSize;
+	}
+	if (mBlocks.size() > mMaxBlocks)
+		_Shrink(mMaxBlocks);
+	mLocker.unlock();
+	return count;
+}
+
+
+void
+RedSeaBlockCache::Update(uint64_t location, uint64_t count, const void *buffer)
+{
+	uint64_t end = location + count;
+	std::vector<RedSeaCacheBlock *> blocks;
+
+	mLocker.lock();
+	do
+		_Overlapping(location, end, blocks);
+	while (!_WaitForIdle(blocks));
+
+	for (size_t i = 0; i < blocks.size(); i++)
+		copy_in(blocks[i], mBlockSize, location, end, (const uint8_t *)buffer);
+	mLocker.unlock();
+}
+
+
+// Brings cached blocks overlapping a range that was changed on the device
+// behind the cache's back up to date. Clean blocks are dropped; dirty ones
+// are reread in part and keep their other contents. Only for devices that
+// need no alignment.
+void
+RedSeaBlockCache::Refresh(uint64_t location, uint64_t count)
+{
+	uint64_t end = location + count;
+	std::vector<RedSeaCacheBlock *> blocks;
+
+	mLocker.lock();
+	do
+		_Overlapping(location, end, blocks);
+	while (!_WaitForIdle(blocks));
+
+	std::vector<RedSeaCacheBlock *> dirty;
+	for (size_t i = 0; i < blocks.size(); i++) {
+		if (blocks[i]->mDirty) {
+			blocks[i]->mFilling = true;
+			dirty.push_back(blocks[i]);
+		} else
+			_Remove(blocks[i]);
+	}
+	mLocker.unlock();
+	if (dirty.empty())
+		return;
+
+	for (size_t i = 0; i < dirty.size(); i++) {
+		RedSeaCacheBlock *block = dirty[i];
+		uint64_t from = std::max(block->mLocation, location);
+		uint64_t to = std::min(block->mLocation + _Length(block), end);
+		if (from < to) {
+			mVolume->_ReadDirect(from, to - from,
+				block->mData + (from - block->mLocation));
+		}
+	}
+
+	mLocker.lock();
+	for (size_t i = 0; i < dirty.size(); i++)
+		dirty[i]->mFilling = false;
+	mIdleCondition.notify_all();
+	mLocker.unlock();
+}
+
+
+// Clean blocks are copied as well: one written back after the device was
+// read still holds what the reader has to see. Blocks still being filled
+// hold nothing newer than the device.
+void
+RedSeaBlockCache::Overlay(uint64_t location, uint64_t count, void *buffer)
+{
+	uint64_t end = location + count;
+	std::vector<RedSeaCacheBlock *> blocks;
+
+	mLocker.lock();
+	_Overlapping(location, end, blocks);
+	for (size_t i = 0; i < blocks.size(); i++) {
+		if (!blocks[i]->mFilling)
+			copy_out(blocks[i], mBlockSize, location, end, (uint8_t *)buffer);
+	}
+	mLocker.unlock();
+}
+
+
+static bool
+block_location_less(const RedSeaCacheBlock *a, const RedSeaCacheBlock *b)
+{
+	return a->mLocation < b->mLocation;
+}
+
+
+bool
+RedSeaBlockCache::Sync(uint64_t location, uint64_t count)
+{
+	uint64_t end = count > UINT64_MAX - location ? UINT64_MAX : location + count;
+	std::vector<RedSeaCacheBlock *> blocks;
+
+	mLocker.lock();
+	_Overlapping(location, end, blocks);
+
+	// Busy blocks are waited for afterwards: one written back by someone
+	// else has to be on the device before this returns as well.
+	std::vector<RedSeaCacheBlock *> dirty;
+	std::vector<uint64_t> busy;
+	for (size_t i = 0; i < blocks.size(); i++) {
+		if (_IsBusy(blocks[i]))
+			busy.push_back(blocks[i]->mLocation);
+		else if (blocks[i]->mDirty)
+			dirty.push_back(blocks[i]);
+	}
+	std::sort(dirty.begin(), dirty.end(), block_location_less);
+
+	bool success = dirty.empty() || _WriteBack(dirty);
+	for (size_t i = 0; i < busy.size(); i++) {
+		for (;;) {
+			RedSeaCacheBlock *block = _Lookup(busy[i]);
+			if (block != NULL && _IsBusy(block)) {
+				mIdleCondition.wait(mLocker);
+				continue;
+			}
+			if (block != NULL && block->mDirty) {
+				std::vector<RedSeaCacheBlock *> single(1, block);
+				if (!_WriteBack(single))
+					success = false;
+			}
+			break;
+		}
+	}
+
+	mLocker.unlock();
+	return success;
+}
+
+
+void
+RedSeaBlockCache::Prefetch(uint64_t location, uint64_t count)
+{
+	if (location >= mDeviceSize)
+		return;
+	if (count > mDeviceSize - location)
+		count = mDeviceSize - location;
+
+	mLocker.lock();
+	if (mQuitting) {
+		mLocker.unlock();
+		return;
+	}
+	if (mPrefetchQueue.size() >= RS_PREFETCH_QUEUE)
+		mPrefetchQueue.pop_front();
+	Range range = { location, count };
+	mPrefetchQueue.push_back(range);
+	if (!mPrefetcher.joinable())
+		mPrefetcher = std::thread(&RedSeaBlockCache::_PrefetchLoop, this);
+	mLocker.unlock();
+	mPrefetchCondition.notify_one();
+}
+
+
+void
+RedSeaBlockCache::_PrefetchLoop()
+{
+	std::unique_lock<std::mutex> lock(mLocker);
+	for (;;) {
+		while (mPrefetchQueue.empty() && !mQuitting)
+			mPrefetchCondition.wait(lock);
+		if (mQuitting)
+			return;
+
+		Range range = mPrefetchQueue.front();
+		mPrefetchQueue.pop_front();
+		lock.unlock();
+		Read(range.mLocation, range.mCount, NULL);
+		lock.lock();
+	}
+}
+
+
+RedSeaCacheBlock *
+RedSeaBlockCache::_Lookup(uint64_t location)
+{
+	std::unordered_map<uint64_t, RedSeaCacheBlock *>::iterator found
+		= mBlocks.find(location);
+	if (found == mBlocks.end())
+		return NULL;
+	return found->second;
+}
+
+
+// Collects the cached blocks overlapping [location, end). Short ranges,
+// like those of a single read, are looked up block by block.
+void
+RedSeaBlockCache::_Overlapping(uint64_t location, uint64_t end,
+	std::vector<RedSeaCacheBlock *> &blocks)
+{
+	blocks.clear();
+	if ((end - location) / mBlockSize > mBlocks.size()) {
+		for (RedSeaCacheBlock *block = mHead; block != NULL; block = block->mNext) {
+			if (block->mLocation + mBlockSize > location && block->mLocation < end)
+				blocks.push_back(block);
+		}
+	} else {
+		uint64_t block = location - location % mBlockSize;
+		for (; block < end; block += mBlockSize) {
+			RedSeaCacheBlock *cached = _Lookup(block);
+			if (cached != NULL)
+				blocks.push_back(cached);
+		}
+	}
+}
+
+
+// If one of the blocks is busy, waits for blocks to become idle and returns
+// false. The blocks may be gone by then and have to be collected again.
+bool
+RedSeaBlockCache::_WaitForIdle(const std::vector<RedSeaCacheBlock *> &blocks)
+{
+	for (size_t i = 0; i < blocks.size(); i++) {
+		if (_IsBusy(blocks[i])) {
+			mIdleCondition.wait(mLocker);
+			return false;
+		}
+	}
+	return true;
+}
+
+
+RedSeaCacheBlock *
+RedSeaBlockCache::_Allocate(uint64_t location)
+{
+	RedSeaCacheBlock *block = new RedSeaCacheBlock;
+	block->mLocation = location;
+	block->mDirty = false;
+	block->mFilling = false;
+	block->mWriting = false;
+	block->mPrevious = NULL;
+	block->mNext = NULL;
+	void *data;
+	if (posix_memalign(&data, mBlockSize, mBlockSize) != 0)
+		data = malloc(mBlockSize);
+	block->mData = (uint8_t *)data;
+	return block;
+}
+
+
+// Blocks are only evicted by _Shrink(), once the caller is done with them;
+// until then, the cache may exceed its budget by the blocks of a request.
+void
+RedSeaBlockCache::_Insert(RedSeaCacheBlock *block)
+{
+	mBlocks[block->mLocation] = block;
+	block->mPrevious = NULL;
+	block->mNext = mHead;
+	if (mHead != NULL)
+		mHead->mPrevious = block;
+	mHead = block;
+	if (mTail == NULL)
+		mTail = block;
+}
+
+
+void
+RedSeaBlockCache::_Touch(RedSeaCacheBlock *block)
+{
+	if (block == mHead)
+		return;
+
+	_Unlink(block);
+	block->mNext = mHead;
+	if (mHead != NULL)
+		mHead->mPrevious = block;
+	mHead = block;
+	if (mTail == NULL)
+		mTail = block;
+}
+
+
+void
+RedSeaBlockCache::_Unlink(RedSeaCacheBlock *block)
+{
+	if (block->mPrevious != NULL)
+		block->mPrevious->mNext = block->mNext;
+	else
+		mHead = block->mNext;
+	if (block->mNext != NULL)
+		block->mNext->mPrevious = block->mPrevious;
+	else
+		mTail = block->mPrevious;
+	block->mPrevious = NULL;
+	block->mNext = NULL;
+}
+
+
+void
+RedSeaBlockCache::_Remove(RedSeaCacheBlock *block)
+{
+	_Unlink(block);
+	mBlocks.erase(block->mLocation);
+	_Free(block);
+}
+
+
+void
+RedSeaBlockCache::_Free(RedSeaCacheBlock *block)
+{
+	free(block->mData);
+	delete block;
+}
+
+
+uint32_t
+RedSeaBlockCache::_Length(RedSeaCacheBlock *block)
+{
+	if (block->mLocation + mBlockSize > mDeviceSize)
+		return mDeviceSize - block->mLocation;
+	return mBlockSize;
+}
+
+
+// Writes back the blocks, which have to be sorted by location: one vectored
+// request per contiguous run, all runs as one batch. The lock is dropped
+// meanwhile, with the blocks marked as being written back so that they
+// stay as they are. Blocks that could not be written back are dirty again.
+bool
+RedSeaBlockCache::_WriteBack(std::vector<RedSeaCacheBlock *> &blocks)
+{
+	for (size_t i = 0; i < blocks.size(); i++) {
+		blocks[i]->mWriting = true;
+		blocks[i]->mDirty = false;
+	}
+	mLocker.unlock();
+
+	// the vectors are reserved up front so that they stay in place
+	std::vector<bool> written(blocks.size(), false);
+	std::vector<struct iovec> vecs;
+	vecs.reserve(blocks.size());
+	std::vector<RedSeaIORequest> requests;
+	std::vector<size_t> firstBlocks;
+	size_t i = 0;
+	while (i < blocks.size()) {
+		size_t runLength = 0;
+		while (i + runLength < blocks.size() && runLength < RS_CACHE_MAX_RUN
+			&& blocks[i + runLength]->mLocation
+				== blocks[i]->mLocation + runLength * mBlockSize
+			&& _Length(blocks[i + runLength]) == mBlockSize) {
+			struct iovec vec = { blocks[i + runLength]->mData, mBlockSize };
+			vecs.push_back(vec);
+			runLength++;
+		}
+
+		if (runLength == 0) {
+			// a block cut short by the end of the device
+			uint32_t length = _Length(blocks[i]);
+			written[i] = mVolume->_WriteDirect(blocks[i]->mLocation, length,
+				blocks[i]->mData) == length;
+			i++;
+			continue;
+		}
+
+		RedSeaIORequest request;
+		request.mLocation = blocks[i]->mLocation;
+		request.mVecs = &vecs[vecs.size() - runLength];
+		request.mVecCount = runLength;
+		request.mWrite = true;
+		request.mResult = -1;
+		requests.push_back(request);
+		firstBlocks.push_back(i);
+		i += runLength;
+	}
+
+	if (!requests.empty())
+		mVolume->mDevice->Transfer(&requests[0], requests.size());
+	for (size_t r = 0; r < requests.size(); r++) {
+		size_t first = firstBlocks[r];
+		size_t runLength = requests[r].mVecCount;
+		for (size_t j = first; j < first + runLength; j++) {
+			if (requests[r].mResult == (ssize_t)runLength * mBlockSize)
+				written[j] = true;
+			else {
+				written[j] = mVolume->_WriteDirect(blocks[j]->mLocation,
+					mBlockSize, blocks[j]->mData) == mBlockSize;
+			}
+		}
+	}
+
+	mLocker.lock();
+	bool success = true;
+	for (i = 0; i < blocks.size(); i++) {
+		blocks[i]->mWriting = false;
+		if (!written[i]) {
+			blocks[i]->mDirty = true;
+			success = false;
+		}
+	}
+	mIdleCondition.notify_all();
+	return success;
+}
+
+
+// Evicts blocks from the least recently used end until at most maxBlocks
+// are left, skipping busy ones. Clean blocks go right away; dirty ones are
+// written back, without holding the lock, and go if that worked. One that
+// fails stays, and does not keep the clean blocks from being evicted.
+// Callers must not hold on to any block across this.
+void
+RedSeaBlockCache::_Shrink(uint64_t maxBlocks)
+{
+	std::vector<RedSeaCacheBlock *> dirty;
+	RedSeaCacheBlock *block = mTail;
+	while (block != NULL && mBlocks.size() - dirty.size() > maxBlocks) {
+		RedSeaCacheBlock *previous = block->mPrevious;
+		if (!_IsBusy(block)) {
+			if (block->mDirty)
+				dirty.push_back(block);
+			else
+				_Remove(block);
+		}
+		block = previous;
+	}
+	if (dirty.empty())
+		return;
+
+	std::sort(dirty.begin(), dirty.end(), block_location_less);
+	_WriteBack(dirty);
+	for (size_t i = 0; i < dirty.size() && mBlocks.size() > maxBlocks; i++) {
+		if (!dirty[i]->mDirty && !_IsBusy(dirty[i]))
+			_Remove(dirty[i]);
+	}
+}
+
+
+bool
+RedSeaBlockCache::_Fill(RedSeaCacheBlock *block)
+{
+	uint64_t bytes = mVolume->_ReadDirect(block->mLocation, mBlockSize,
+		block->mData);
+	if (bytes == 0)
+		return false;
+	if (bytes < mBlockSize)
+		memset(block->mData + bytes, 0, mBlockSize - bytes);
+	return true;
+}
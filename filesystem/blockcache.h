@@ -0,0 +1,97 @@
+#ifndef REDSEA_BLOCKCACHE_H
+#define REDSEA_BLOCKCACHE_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class RedSea;
+
+struct RedSeaCacheBlock {
+	uint64_t			mLocation;
+	bool				mDirty;
+	// Device I/O on a block runs without the cache lock. Its contents are
+	// not valid while it is filled, and must not change while it is
+	// written back; neither kind of busy block is evicted.
+	bool				mFilling;
+	bool				mWriting;
+	RedSeaCacheBlock *	mPrevious;
+	RedSeaCacheBlock *	mNext;
+	uint8_t *			mData;
+};
+
+// Write-back cache of fixed size device blocks with LRU eviction. Device
+// I/O is done through the owning volume so short transfers, alignment and
+// the transfer size limit are handled in one place, and never while
+// holding the cache lock.
+class RedSeaBlockCache {
+public:
+						RedSeaBlockCache(RedSea *volume, uint64_t deviceSize,
+							uint64_t budget, uint32_t blockSize = 0x1000);
+						~RedSeaBlockCache();
+	uint32_t			BlockSize() const { return mBlockSize; }
+	uint64_t			Budget() const { return mMaxBlocks * mBlockSize; }
+	void				SetBudget(uint64_t budget);
+	uint64_t			Read(uint64_t location, uint64_t count, void *buffer);
+	uint64_t			Write(uint64_t location, uint64_t count,
+							const void *buffer);
+	// Keep cached copies coherent with a transfer that bypasses the cache:
+	// Update before writing to the device, Overlay after reading from it.
+	void				Update(uint64_t location, uint64_t count,
+							const void *buffer);
+	void				Overlay(uint64_t location, uint64_t count,
+							void *buffer);
+	void				Refresh(uint64_t location, uint64_t count);
+	// writes back the dirty blocks overlapping [location, location + count)
+	bool				Sync(uint64_t location = 0,
+							uint64_t count = UINT64_MAX);
+	// Loads the range in the background; returns at once.
+	void				Prefetch(uint64_t location, uint64_t count);
+private:
+	struct Range {
+		uint64_t		mLocation;
+		uint64_t		mCount;
+	};
+
+	static bool			_IsBusy(const RedSeaCacheBlock *block)
+							{ return block->mFilling || block->mWriting; }
+	RedSeaCacheBlock *	_Lookup(uint64_t location);
+	void				_Overlapping(uint64_t location, uint64_t end,
+							std::vector<RedSeaCacheBlock *> &blocks);
+	bool				_WaitForIdle(
+							const std::vector<RedSeaCacheBlock *> &blocks);
+	RedSeaCacheBlock *	_Allocate(uint64_t location);
+	void				_Insert(RedSeaCacheBlock *block);
+	void				_Touch(RedSeaCacheBlock *block);
+	void				_Unlink(RedSeaCacheBlock *block);
+	void				_Remove(RedSeaCacheBlock *block);
+	void				_Free(RedSeaCacheBlock *block);
+	uint32_t			_Length(RedSeaCacheBlock *block);
+	bool				_WriteBack(std::vector<RedSeaCacheBlock *> &blocks);
+	void				_Shrink(uint64_t maxBlocks);
+	bool				_Fill(RedSeaCacheBlock *block);
+	void				_PrefetchLoop();
+
+	RedSea *			mVolume;
+	uint64_t			mDeviceSize;
+	std::mutex			mLocker;
+	// signalled whenever blocks stop being busy
+	std::condition_variable_any mIdleCondition;
+	uint32_t			mBlockSize;
+	uint64_t			mMaxBlocks;
+	std::unordered_map<uint64_t, RedSeaCacheBlock *> mBlocks;
+	RedSeaCacheBlock *	mHead; // most recently used
+	RedSeaCacheBlock *	mTail;
+	// pending prefetches, served by mPrefetcher once it has been started
+	std::deque<Range>	mPrefetchQueue;
+	std::condition_variable mPrefetchCondition;
+	std::thread			mPrefetcher;
+	bool				mQuitting;
+};
+
+#endif
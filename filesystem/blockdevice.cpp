@@ -0,0 +1,479 @@
+#include "blockdevice.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+
+static size_t
+vec_length(const struct iovec *vecs, int count)
+{
+	size_t length = 0;
+	for (int i = 0; i < count; i++)
+		length += vecs[i].iov_len;
+	return length;
+}
+
+
+bool
+RedSeaDevice::Transfer(RedSeaIORequest *requests, int count)
+{
+	bool complete = true;
+	for (int i = 0; i < count; i++) {
+		RedSeaIORequest &request = requests[i];
+		ssize_t bytes;
+		do {
+			if (request.mWrite) {
+				bytes = WriteVecAt(request.mLocation, request.mVecs,
+					request.mVecCount);
+			} else {
+				bytes = ReadVecAt(request.mLocation, request.mVecs,
+					request.mVecCount);
+			}
+		} while (bytes < 0 && errno == EINTR);
+
+		request.mResult = bytes;
+		request.mError = bytes < 0 ? errno : 0;
+		if (bytes < 0 || (size_t)bytes != vec_length(request.mVecs,
+				request.mVecCount)) {
+			complete = false;
+		}
+	}
+	return complete;
+}
+
+
+RedSeaFileDevice::RedSeaFileDevice(int fd, uint32_t alignment)
+{
+	mFile = fd;
+	mAlignment = alignment;
+}
+
+
+RedSeaFileDevice::~RedSeaFileDevice()
+{
+	if (mFile >= 0)
+		close(mFile);
+}
+
+
+bool
+RedSeaFileDevice::Sync()
+{
+	return fsync(mFile) == 0;
+}
+
+
+void
+RedSeaFileDevice::Prefetch(uint64_t location, uint64_t count)
+{
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(mFile, location, count, POSIX_FADV_WILLNEED);
+#endif
+}
+
+
+ssize_t
+RedSeaFileDevice::ReadAt(uint64_t location, void *buffer, size_t count)
+{
+	return pread(mFile, buffer, count, location);
+}
+
+
+ssize_t
+RedSeaFileDevice::WriteAt(uint64_t location, const void *buffer, size_t count)
+{
+	return pwrite(mFile, buffer, count, location);
+}
+
+
+ssize_t
+RedSeaFileDevice::ReadVecAt(uint64_t location, const struct iovec *vecs,
+	int count)
+{
+	return preadv(mFile, vecs, count, location);
+}
+
+
+ssize_t
+RedSeaFileDevice::WriteVecAt(uint64_t location, const struct iovec *vecs,
+	int count)
+{
+	return pwritev(mFile, vecs, count, location);
+}
+
+
+RedSeaMappedDevice::RedSeaMappedDevice(int fd, bool writable)
+	:
+	RedSeaFileDevice(fd),
+	mMapping(NULL),
+	mSize(0),
+	mWritable(writable)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0)
+		return;
+
+	void *mapping = mmap(NULL, st.st_size,
+		writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED)
+		return;
+
+	mMapping = (uint8_t *)mapping;
+	mSize = st.st_size;
+}
+
+
+RedSeaMappedDevice::~RedSeaMappedDevice()
+{
+	if (mMapping != NULL)
+		munmap(mMapping, mSize);
+}
+
+
+void
+RedSeaMappedDevice::Prefetch(uint64_t location, uint64_t count)
+{
+	if (mMapping == NULL) {
+		RedSeaFileDevice::Prefetch(location, count);
+		return;
+	}
+	if (location >= mSize)
+		return;
+	if (count > mSize - location)
+		count = mSize - location;
+
+#ifdef POSIX_MADV_WILLNEED
+	uint64_t offset = location % getpagesize();
+	posix_madvise(mMapping + location - offset, count + offset,
+		POSIX_MADV_WILLNEED);
+#endif
+}
+
+
+ssize_t
+RedSeaMappedDevice::ReadAt(uint64_t location, void *buffer, size_t count)
+{
+	if (mMapping == NULL)
+		return RedSeaFileDevice::ReadAt(location, buffer, count);
+
+	if (location >= mSize)
+		return 0;
+	if (count > mSize - location)
+		count = mSize - location;
+	memcpy(buffer, mMapping + location, count);
+	return count;
+}
+
+
+ssize_t
+RedSeaMappedDevice::WriteAt(uint64_t location, const void *buffer,
+	size_t count)
+{
+	if (mMapping == NULL)
+		return RedSeaFileDevice::WriteAt(location, buffer, count);
+
+	if (!mWritable) {
+		errno = EROFS;
+		return -1;
+	}
+	// the mapping cannot grow the file
+	if (location >= mSize) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (count > mSize - location)
+		count = mSize - location;
+	// the source may be the mapping itself
+	memmove(mMapping + location, buffer, count);
+	return count;
+}
+
+
+ssize_t
+RedSeaMappedDevice::ReadVecAt(uint64_t location, const struct iovec *vecs,
+	int count)
+{
+	if (mMapping == NULL)
+		return RedSeaFileDevice::ReadVecAt(location, vecs, count);
+
+	ssize_t total = 0;
+	for (int i = 0; i < count; i++) {
+		ssize_t bytes = ReadAt(location + total, vecs[i].iov_base,
+			vecs[i].iov_len);
+		total += bytes;
+		if ((size_t)bytes < vecs[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+
+ssize_t
+RedSeaMappedDevice::WriteVecAt(uint64_t location, const struct iovec *vecs,
+	int count)
+{
+	if (mMapping == NULL)
+		return RedSeaFileDevice::WriteVecAt(location, vecs, count);
+
+	ssize_t total = 0;
+	for (int i = 0; i < count; i++) {
+		ssize_t bytes = WriteAt(location + total, vecs[i].iov_base,
+			vecs[i].iov_len);
+		if (bytes < 0)
+			return total > 0 ? total : bytes;
+		total += bytes;
+		if ((size_t)bytes < vecs[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+
+bool
+RedSeaMappedDevice::Sync()
+{
+	if (mMapping == NULL)
+		return RedSeaFileDevice::Sync();
+	if (!mWritable)
+		return true;
+	return msync(mMapping, mSize, MS_SYNC) == 0;
+}
+
+
+RedSeaUringDevice::RedSeaUringDevice(int fd, uint32_t alignment,
+	uint32_t queueDepth)
+	:
+	RedSeaFileDevice(fd, alignment),
+	mRing(-1),
+	mQueueDepth(0),
+	mSubmitRing(NULL),
+	mSubmitRingSize(0),
+	mCompleteRing(NULL),
+	mCompleteRingSize(0),
+	mSubmitEntries(NULL),
+	mSubmitEntriesSize(0)
+{
+#ifdef __linux__
+	if (queueDepth == 0)
+		return;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	mRing = syscall(__NR_io_uring_setup, queueDepth, &params);
+	if (mRing < 0) {
+		mRing = -1;
+		return;
+	}
+
+	mSubmitRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	mCompleteRingSize = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single && mCompleteRingSize > mSubmitRingSize)
+		mSubmitRingSize = mCompleteRingSize;
+
+	void *ring = mmap(NULL, mSubmitRingSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, mRing, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED) {
+		mSubmitRingSize = 0;
+		_Close();
+		return;
+	}
+	mSubmitRing = (uint8_t *)ring;
+
+	if (single) {
+		// shares the submission ring's mapping
+		mCompleteRing = mSubmitRing;
+		mCompleteRingSize = 0;
+	} else {
+		ring = mmap(NULL, mCompleteRingSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, mRing, IORING_OFF_CQ_RING);
+		if (ring == MAP_FAILED) {
+			mCompleteRingSize = 0;
+			_Close();
+			return;
+		}
+		mCompleteRing = (uint8_t *)ring;
+	}
+
+	mSubmitEntriesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring = mmap(NULL, mSubmitEntriesSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, mRing, IORING_OFF_SQES);
+	if (ring == MAP_FAILED) {
+		mSubmitEntriesSize = 0;
+		_Close();
+		return;
+	}
+	mSubmitEntries = (struct io_uring_sqe *)ring;
+
+	mSubmitHead = (uint32_t *)(mSubmitRing + params.sq_off.head);
+	mSubmitTail = (uint32_t *)(mSubmitRing + params.sq_off.tail);
+	mSubmitMask = *(uint32_t *)(mSubmitRing + params.sq_off.ring_mask);
+	mSubmitArray = (uint32_t *)(mSubmitRing + params.sq_off.array);
+	mCompleteHead = (uint32_t *)(mCompleteRing + params.cq_off.head);
+	mCompleteTail = (uint32_t *)(mCompleteRing + params.cq_off.tail);
+	mCompleteMask = *(uint32_t *)(mCompleteRing + params.cq_off.ring_mask);
+	mCompleteEntries = (struct io_uring_cqe *)(mCompleteRing
+		+ params.cq_off.cqes);
+	mQueueDepth = params.sq_entries;
+#endif
+}
+
+
+RedSeaUringDevice::~RedSeaUringDevice()
+{
+	_Close();
+}
+
+
+bool
+RedSeaUringDevice::Transfer(RedSeaIORequest *requests, int count)
+{
+	if (mRing < 0 || count < 2)
+		return RedSeaFileDevice::Transfer(requests, count);
+
+	// the ring has a single submitter; others do without it
+	std::unique_lock<std::mutex> ringLock(mRingLocker, std::try_to_lock);
+	if (!ringLock.owns_lock() || mRing < 0)
+		return RedSeaFileDevice::Transfer(requests, count);
+
+	int next = 0;
+	int done = 0;
+	uint32_t inFlight = 0;
+	uint32_t queued = 0;
+	bool failed = false;
+	while (done < count) {
+		while (next < count && inFlight + queued < mQueueDepth) {
+			_Queue(requests[next], next);
+			next++;
+			queued++;
+		}
+
+		int submitted = _Enter(queued, 1);
+		if (submitted < 0 && errno != EINTR && errno != EAGAIN
+			&& errno != EBUSY) {
+			failed = true;
+			break;
+		}
+		if (submitted > 0) {
+			queued -= submitted;
+			inFlight += submitted;
+		}
+
+		int reaped = _Reap(requests);
+		inFlight -= reaped;
+		done += reaped;
+	}
+
+	if (failed) {
+		// Take back what the kernel did not consume, wait for the rest, and
+		// carry out the remaining requests without the ring. The requests in
+		// flight still refer to the caller's buffers, so the ring must not be
+		// torn down before they have completed; if waiting for them fails,
+		// the completion ring is polled instead.
+		__atomic_store_n(mSubmitTail, *mSubmitTail - queued, __ATOMIC_RELEASE);
+		next -= queued;
+		bool broken = false;
+		while (inFlight > 0) {
+			if (!broken && _Enter(0, 1) < 0 && errno != EINTR
+				&& errno != EAGAIN && errno != EBUSY) {
+				broken = true;
+			}
+			int reaped = _Reap(requests);
+			inFlight -= reaped;
+			if (broken && reaped == 0)
+				usleep(1000);
+		}
+		if (broken)
+			_Close();
+		RedSeaFileDevice::Transfer(requests + next, count - next);
+	}
+
+	bool complete = true;
+	for (int i = 0; i < count; i++) {
+		if (requests[i].mResult < 0 || (size_t)requests[i].mResult
+				!= vec_length(requests[i].mVecs, requests[i].mVecCount)) {
+			complete = false;
+		}
+	}
+	return complete;
+}
+
+
+void
+RedSeaUringDevice::_Queue(const RedSeaIORequest &request, uint64_t tag)
+{
+#ifdef __linux__
+	uint32_t tail = *mSubmitTail;
+	uint32_t index = tail & mSubmitMask;
+	struct io_uring_sqe *entry = &mSubmitEntries[index];
+	memset(entry, 0, sizeof(*entry));
+	entry->opcode = request.mWrite ? IORING_OP_WRITEV : IORING_OP_READV;
+	entry->fd = mFile;
+	entry->off = request.mLocation;
+	entry->addr = (uintptr_t)request.mVecs;
+	entry->len = request.mVecCount;
+	entry->user_data = tag;
+	mSubmitArray[index] = index;
+	__atomic_store_n(mSubmitTail, tail + 1, __ATOMIC_RELEASE);
+#endif
+}
+
+
+// Submits the queued entries and waits for completions; returns how many
+// entries the kernel consumed, or -1.
+int
+RedSeaUringDevice::_Enter(uint32_t submit, uint32_t wait)
+{
+#ifdef __linux__
+	return syscall(__NR_io_uring_enter, mRing, submit, wait,
+		wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+int
+RedSeaUringDevice::_Reap(RedSeaIORequest *requests)
+{
+	int reaped = 0;
+#ifdef __linux__
+	uint32_t head = *mCompleteHead;
+	uint32_t tail = __atomic_load_n(mCompleteTail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, reaped++) {
+		struct io_uring_cqe *entry = &mCompleteEntries[head & mCompleteMask];
+		RedSeaIORequest &request = requests[entry->user_data];
+		request.mResult = entry->res < 0 ? -1 : entry->res;
+		request.mError = entry->res < 0 ? -entry->res : 0;
+	}
+	__atomic_store_n(mCompleteHead, head, __ATOMIC_RELEASE);
+#endif
+	return reaped;
+}
+
+
+void
+RedSeaUringDevice::_Close()
+{
+	if (mSubmitEntriesSize > 0)
+		munmap(mSubmitEntries, mSubmitEntriesSize);
+	if (mCompleteRingSize > 0)
+		munmap(mCompleteRing, mCompleteRingSize);
+	if (mSubmitRingSize > 0)
+		munmap(mSubmitRing, mSubmitRingSize);
+	mSubmitEntriesSize = mCompleteRingSize = mSubmitRingSize = 0;
+	if (mRing >= 0)
+		close(mRing);
+	mRing = -1;
+}
@@ -0,0 +1,136 @@
+#ifndef REDSEA_BLOCKDEVICE_H
+#define REDSEA_BLOCKDEVICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <mutex>
+
+// One transfer of a batch. On return, mResult holds the byte count or -1,
+// with the error code in mError.
+struct RedSeaIORequest {
+	uint64_t			mLocation;
+	const struct iovec *mVecs;
+	int					mVecCount;
+	bool				mWrite;
+	ssize_t				mResult;
+	int					mError;
+};
+
+// Backend for all volume I/O. Every request carries its own position, so
+// implementations must not keep a shared file offset and need no locking
+// between concurrent callers.
+class RedSeaDevice {
+public:
+	virtual				~RedSeaDevice() {}
+	// Required alignment of positions, lengths and memory buffers; 1 if
+	// the device accepts arbitrary transfers.
+	virtual uint32_t	Alignment() const { return 1; }
+	// Descriptor the data can be read from directly, or -1 if there is none.
+	virtual int			FileDescriptor() const { return -1; }
+	// The device contents as memory, if they are mapped. Stores into the
+	// mapping are only allowed when the device is not read-only.
+	virtual uint8_t *	Mapping() const { return NULL; }
+	virtual uint64_t	MappingSize() const { return 0; }
+	virtual bool		IsReadOnly() const { return false; }
+	// Makes everything written so far durable.
+	virtual bool		Sync() { return true; }
+	// Hints that the range is going to be read soon.
+	virtual void		Prefetch(uint64_t /*location*/, uint64_t /*count*/) {}
+	virtual ssize_t		ReadAt(uint64_t location, void *buffer, size_t count) = 0;
+	virtual ssize_t		WriteAt(uint64_t location, const void *buffer,
+							size_t count) = 0;
+	virtual ssize_t		ReadVecAt(uint64_t location, const struct iovec *vecs,
+							int count) = 0;
+	virtual ssize_t		WriteVecAt(uint64_t location, const struct iovec *vecs,
+							int count) = 0;
+	// Carries out independent transfers, in any order and possibly
+	// concurrently. Like ReadVecAt()/WriteVecAt(), a request may complete
+	// short. Returns whether every request was transferred in full.
+	virtual bool		Transfer(RedSeaIORequest *requests, int count);
+};
+
+class RedSeaFileDevice : public RedSeaDevice {
+public:
+						RedSeaFileDevice(int fd, uint32_t alignment = 1);
+	virtual				~RedSeaFileDevice();
+	virtual int			FileDescriptor() const { return mFile; }
+	virtual uint32_t	Alignment() const { return mAlignment; }
+	virtual bool		Sync();
+	virtual void		Prefetch(uint64_t location, uint64_t count);
+	virtual ssize_t		ReadAt(uint64_t location, void *buffer, size_t count);
+	virtual ssize_t		WriteAt(uint64_t location, const void *buffer,
+							size_t count);
+	virtual ssize_t		ReadVecAt(uint64_t location, const struct iovec *vecs,
+							int count);
+	virtual ssize_t		WriteVecAt(uint64_t location, const struct iovec *vecs,
+							int count);
+protected:
+	int					mFile;
+	uint32_t			mAlignment;
+};
+
+// Serves an image file from a shared memory mapping, so that transfers are
+// plain copies. If the file cannot be mapped, it falls back to the
+// positional I/O of RedSeaFileDevice.
+class RedSeaMappedDevice : public RedSeaFileDevice {
+public:
+						RedSeaMappedDevice(int fd, bool writable);
+	virtual				~RedSeaMappedDevice();
+	virtual uint8_t *	Mapping() const { return mMapping; }
+	virtual uint64_t	MappingSize() const { return mSize; }
+	virtual bool		IsReadOnly() const { return !mWritable; }
+	virtual void		Prefetch(uint64_t location, uint64_t count);
+	virtual ssize_t		ReadAt(uint64_t location, void *buffer, size_t count);
+	virtual ssize_t		WriteAt(uint64_t location, const void *buffer,
+							size_t count);
+	virtual ssize_t		ReadVecAt(uint64_t location, const struct iovec *vecs,
+							int count);
+	virtual ssize_t		WriteVecAt(uint64_t location, const struct iovec *vecs,
+							int count);
+	virtual bool		Sync();
+private:
+	uint8_t *			mMapping;
+	uint64_t			mSize;
+	bool				mWritable;
+};
+
+// Submits batches through an io_uring of the given queue depth, keeping up
+// to that many requests in flight. Single transfers, and batches issued
+// while another thread is using the ring, go through positional I/O, as
+// does everything if the kernel does not provide io_uring.
+class RedSeaUringDevice : public RedSeaFileDevice {
+public:
+						RedSeaUringDevice(int fd, uint32_t alignment = 1,
+							uint32_t queueDepth = 32);
+	virtual				~RedSeaUringDevice();
+			bool		HasRing() const { return mRing >= 0; }
+	virtual bool		Transfer(RedSeaIORequest *requests, int count);
+private:
+			void		_Queue(const RedSeaIORequest &request, uint64_t tag);
+			int			_Enter(uint32_t submit, uint32_t wait);
+			int			_Reap(RedSeaIORequest *requests);
+			void		_Close();
+
+	int					mRing;
+	uint32_t			mQueueDepth;
+	std::mutex			mRingLocker;
+	uint8_t *			mSubmitRing;
+	size_t				mSubmitRingSize;
+	uint8_t *			mCompleteRing;
+	size_t				mCompleteRingSize;
+	struct io_uring_sqe *mSubmitEntries;
+	size_t				mSubmitEntriesSize;
+	uint32_t *			mSubmitHead;
+	uint32_t *			mSubmitTail;
+	uint32_t			mSubmitMask;
+	uint32_t *			mSubmitArray;
+	uint32_t *			mCompleteHead;
+	uint32_t *			mCompleteTail;
+	uint32_t			mCompleteMask;
+	struct io_uring_cqe *mCompleteEntries;
+};
+
+#endif
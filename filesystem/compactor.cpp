@@ -0,0 +1,355 @@
+#include "compactor.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "bitmap.h"
+#include "redsea.h"
+
+
+// Longest run given back by a single Deallocate() call.
+#define RS_RECLAIM_RUN	(1 << 30)
+
+
+static inline uint64_t
+sectors_for_size(uint64_t size)
+{
+	uint64_t sectors = (size + 0x1FF) / 0x200;
+	return sectors == 0 ? 1 : sectors;
+}
+
+
+static inline bool
+is_dot_entry(const RSDirEntry &entry)
+{
+	return strncmp(entry.mName, ".", sizeof(entry.mName)) == 0
+		|| strncmp(entry.mName, "..", sizeof(entry.mName)) == 0;
+}
+
+
+RedSeaCompactor::RedSeaCompactor(RedSea *volume)
+	:
+	mVolume(volume),
+	mRootSector(0),
+	mRootSectors(0),
+	mThrottle(0),
+	mPosition(0),
+	mMovedBytes(0),
+	mScanned(false),
+	mSane(true),
+	mDone(false),
+	mNext(0)
+{
+}
+
+
+bool
+RedSeaCompactor::Run(uint64_t budget)
+{
+	if (mDone)
+		return true;
+	if (!mScanned) {
+		if (!_Scan() || !_Reclaim())
+			return false;
+		mScanned = true;
+		mStarted = std::chrono::steady_clock::now();
+	}
+
+	// each extent goes to the lowest run it fits
+	int policy = mVolume->AllocationPolicy();
+	mVolume->SetAllocationPolicy(RS_ALLOCATE_FIRST_FIT);
+
+	bool success = true;
+	uint64_t moved = 0;
+	while (mNext < mOrder.size() && moved < budget) {
+		int index = mOrder[mNext];
+		Extent &extent = mExtents[index];
+		if (extent.mSector < mPosition) {
+			mNext++;
+			continue;
+		}
+
+		// Without a lower run to move to, the free run right below can still
+		// be closed: the extent is staged in the run it got, which grows the
+		// free run below by its old position, and goes down from there. Each
+		// of the two moves is a complete one.
+		uint64_t from = extent.mSector;
+		uint64_t to = mVolume->Allocate(extent.mSectors);
+		uint64_t below = from;
+		if (to != UINT64_MAX && to > from) {
+			below = mVolume->FreeBefore(from);
+			if (below == from) {
+				mVolume->Deallocate(to, extent.mSectors);
+				to = UINT64_MAX;
+			}
+		}
+
+		if (to != UINT64_MAX) {
+			if (!_Move(index, to)) {
+				success = false;
+				break;
+			}
+			moved += extent.mSectors * 0x200;
+			_Throttle(extent.mSectors * 0x200);
+
+			if (below < from
+				&& mVolume->TryAllocateAt(below, extent.mSectors)) {
+				if (!_Move(index, below)) {
+					success = false;
+					break;
+				}
+				moved += extent.mSectors * 0x200;
+				_Throttle(extent.mSectors * 0x200);
+			}
+		}
+
+		mPosition = from + 1;
+		mNext++;
+	}
+
+	mVolume->SetAllocationPolicy(policy);
+	if (!mVolume->Sync())
+		success = false;
+	if (success && mNext == mOrder.size())
+		mDone = true;
+	return success;
+}
+
+
+float
+RedSeaCompactor::Progress() const
+{
+	if (mDone || mOrder.empty())
+		return mDone ? 1.0f : 0.0f;
+	return (float)mNext / mOrder.size();
+}
+
+
+// Collects the extent of every entry reachable from the root directory.
+bool
+RedSeaCompactor::_Scan()
+{
+	RSBoot &boot = mVolume->BootStructure();
+	mRootSector = boot.root_sector - boot.base_offset;
+
+	RSDirEntry root;
+	if (mVolume->Read(mRootSector * 0x200, sizeof(root), &root) != sizeof(root))
+		return false;
+	mRootSectors = sectors_for_size(root.mSize);
+
+	std::unordered_set<uint64_t> seen;
+	seen.insert(mRootSector);
+	mExtents.clear();
+	mSane = true;
+	if (!_ScanDirectory(-1, mRootSector, root.mSize, seen))
+		return false;
+
+	mOrder.resize(mExtents.size());
+	for (size_t i = 0; i < mOrder.size(); i++)
+		mOrder[i] = i;
+	std::sort(mOrder.begin(), mOrder.end(), [this](int a, int b) {
+		return mExtents[a].mSector < mExtents[b].mSector;
+	});
+	mNext = 0;
+	return true;
+}
+
+
+bool
+RedSeaCompactor::_ScanDirectory(int index, uint64_t sector, uint64_t size,
+	std::unordered_set<uint64_t> &seen)
+{
+	RSBoot &boot = mVolume->BootStructure();
+	uint64_t firstSector = boot.bitmap_sectors + 1;
+	uint64_t count = size / sizeof(RSDirEntry);
+	std::vector<RSDirEntry> entries(count);
+	if (count > 0 && mVolume->Read(sector * 0x200, count * sizeof(RSDirEntry),
+			entries.data()) != count * sizeof(RSDirEntry)) {
+		return false;
+	}
+
+	// slot 0 is the directory itself
+	for (uint64_t slot = 1; slot < count; slot++) {
+		const RSDirEntry &entry = entries[slot];
+		if (entry.mAttributes == 0 || (entry.mAttributes & RS_ATTR_DELETED)
+			|| is_dot_entry(entry)) {
+			continue;
+		}
+
+		Extent extent;
+		extent.mSector = entry.mCluster - boot.base_offset;
+		extent.mSectors = sectors_for_size(entry.mSize);
+		extent.mParent = index;
+		extent.mSlot = slot;
+		extent.mDirectory = (entry.mAttributes & RS_ATTR_DIR) != 0;
+
+		// whatever does not look sane stays where it is
+		if (extent.mSector < firstSector || extent.mSector > boot.count
+			|| extent.mSectors > boot.count - extent.mSector) {
+			mSane = false;
+			continue;
+		}
+		if (extent.mDirectory && !seen.insert(extent.mSector).second)
+			continue;
+
+		mExtents.push_back(extent);
+		if (extent.mDirectory && !_ScanDirectory(mExtents.size() - 1,
+				extent.mSector, entry.mSize, seen)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// Rebuilds the allocation bitmap from the extents found by the scan. A move
+// that was interrupted can leave its new run allocated with nothing
+// pointing at it; this gives such runs back. Runs that are in use but
+// marked free are allocated. A tree with entries that did not look sane is
+// left alone.
+bool
+RedSeaCompactor::_Reclaim()
+{
+	if (!mSane)
+		return true;
+
+	RSBoot &boot = mVolume->BootStructure();
+	uint64_t first = boot.bitmap_sectors + 1;
+	uint64_t bits = boot.count - first;
+	std::vector<uint8_t> used((bits + 7) / 8);
+	bitmap_set_range(used.data(), mRootSector - first, mRootSectors);
+	for (size_t i = 0; i < mExtents.size(); i++) {
+		bitmap_set_range(used.data(), mExtents[i].mSector - first,
+			mExtents[i].mSectors);
+	}
+
+	std::vector<uint8_t> orphaned(used.size());
+	std::vector<uint8_t> missing(used.size());
+	mVolume->mAllocationLocker.lock();
+	const uint8_t *map = mVolume->mBitmapSectors;
+	for (size_t i = 0; i < used.size(); i++) {
+		orphaned[i] = map[i] & ~used[i];
+		missing[i] = used[i] & ~map[i];
+	}
+	mVolume->mAllocationLocker.unlock();
+
+	uint64_t bit = bitmap_find_set(orphaned.data(), bits, 0);
+	while (bit < bits) {
+		uint64_t end = bitmap_find_clear_run(orphaned.data(), bits, bit, 1);
+		if (end == BITMAP_NOT_FOUND)
+			end = bits;
+		for (; bit < end; bit += RS_RECLAIM_RUN) {
+			mVolume->Deallocate(first + bit,
+				end - bit < RS_RECLAIM_RUN ? end - bit : RS_RECLAIM_RUN);
+		}
+		bit = bitmap_find_set(orphaned.data(), bits, end);
+	}
+
+	bit = bitmap_find_set(missing.data(), bits, 0);
+	while (bit < bits) {
+		uint64_t end = bitmap_find_clear_run(missing.data(), bits, bit, 1);
+		if (end == BITMAP_NOT_FOUND)
+			end = bits;
+		mVolume->ForceAllocate(first + bit, end - bit);
+		bit = bitmap_find_set(missing.data(), bits, end);
+	}
+	return mVolume->_FlushBitmap();
+}
+
+
+uint64_t
+RedSeaCompactor::_SlotLocation(const Extent &extent) const
+{
+	uint64_t table = extent.mParent < 0
+		? mRootSector : mExtents[extent.mParent].mSector;
+	return table * 0x200 + extent.mSlot * sizeof(RSDirEntry);
+}
+
+
+// Moves one extent to "to", which has already been allocated and is given
+// back if nothing points at it yet when an error occurs.
+bool
+RedSeaCompactor::_Move(int index, uint64_t to)
+{
+	Extent &extent = mExtents[index];
+	uint64_t base = mVolume->BaseOffset();
+	uint64_t bytes = extent.mSectors * 0x200;
+
+	// the new run is marked and holds the data before anything points at it
+	if (!mVolume->_FlushBitmap()
+		|| !mVolume->_Copy(extent.mSector * 0x200, to * 0x200, bytes)
+		|| !mVolume->Sync()) {
+		mVolume->Deallocate(to, extent.mSectors);
+		return false;
+	}
+
+	RSDirEntry entry;
+	uint64_t location = _SlotLocation(extent);
+	if (mVolume->Read(location, sizeof(entry), &entry) != sizeof(entry)) {
+		mVolume->Deallocate(to, extent.mSectors);
+		return false;
+	}
+	entry.mCluster = to + base;
+	if (mVolume->Write(location, sizeof(entry), &entry) != sizeof(entry))
+		return false;
+
+	if (extent.mDirectory) {
+		// "." of the table itself and ".." of every subdirectory in it
+		uint64_t count = bytes / sizeof(RSDirEntry);
+		std::vector<RSDirEntry> entries(count);
+		if (mVolume->Read(to * 0x200, bytes, entries.data()) != bytes)
+			return false;
+
+		entries[0].mCluster = to + base;
+		if (mVolume->Write(to * 0x200, sizeof(RSDirEntry), &entries[0])
+				!= sizeof(RSDirEntry)) {
+			return false;
+		}
+
+		for (uint64_t slot = 1; slot < count; slot++) {
+			const RSDirEntry &child = entries[slot];
+			if (!(child.mAttributes & RS_ATTR_DIR)
+				|| (child.mAttributes & RS_ATTR_DELETED) || is_dot_entry(child)) {
+				continue;
+			}
+
+			RSDirEntry parent;
+			uint64_t parentLocation = (child.mCluster - base) * 0x200
+				+ sizeof(RSDirEntry);
+			if (mVolume->Read(parentLocation, sizeof(parent), &parent)
+					!= sizeof(parent)) {
+				return false;
+			}
+			if (strncmp(parent.mName, "..", sizeof(parent.mName)) != 0)
+				continue;
+			parent.mCluster = to + base;
+			if (mVolume->Write(parentLocation, sizeof(parent), &parent)
+					!= sizeof(parent)) {
+				return false;
+			}
+		}
+	}
+
+	// only once the entries are on disk can the old run be reused
+	if (!mVolume->Sync())
+		return false;
+	mVolume->Deallocate(extent.mSector, extent.mSectors);
+	extent.mSector = to;
+	return mVolume->_FlushBitmap();
+}
+
+
+void
+RedSeaCompactor::_Throttle(uint64_t bytes)
+{
+	mMovedBytes += bytes;
+	if (mThrottle == 0)
+		return;
+
+	// sleep until the copy rate is back under the limit
+	std::chrono::duration<double> due((double)mMovedBytes / mThrottle);
+	std::this_thread::sleep_until(mStarted
+		+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(due));
+}
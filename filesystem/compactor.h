@@ -0,0 +1,69 @@
+#ifndef REDSEA_COMPACTOR_H
+#define REDSEA_COMPACTOR_H
+
+#include <stdint.h>
+
+#include <chrono>
+#include <unordered_set>
+#include <vector>
+
+class RedSea;
+
+// Moves file and directory extents into the lowest free runs they fit, so
+// that free space coalesces at the end of the volume. An extent that fits
+// no lower run but has a free run right below it goes up to a free run and
+// from there down into the free run, grown by its old position. The volume
+// must not be mounted. Every move is on disk before the entries pointing at
+// it are changed, and only then is the old extent freed, so the compactor
+// can be stopped between any two moves and resumed from Position() later.
+// A move that is interrupted leaves its new run allocated; the next run of
+// a compactor rebuilds the bitmap from the directory tree, which frees it
+// again.
+class RedSeaCompactor {
+public:
+						RedSeaCompactor(RedSea *volume);
+	// Limits the copy rate; 0 does not throttle.
+	void				SetThrottle(uint64_t bytesPerSecond)
+							{ mThrottle = bytesPerSecond; }
+	// Extents starting below "sector" are left where they are.
+	void				SetPosition(uint64_t sector) { mPosition = sector; }
+	uint64_t			Position() const { return mPosition; }
+	// Moves extents until about "budget" bytes have been copied or the
+	// pass is complete. Returns false on an I/O error.
+	bool				Run(uint64_t budget = UINT64_MAX);
+	bool				IsDone() const { return mDone; }
+	float				Progress() const;
+	uint64_t			MovedBytes() const { return mMovedBytes; }
+private:
+	struct Extent {
+		uint64_t		mSector;
+		uint64_t		mSectors;
+		int				mParent; // index of the holding directory, -1 for root
+		uint32_t		mSlot;
+		bool			mDirectory;
+	};
+
+	bool				_Scan();
+	bool				_ScanDirectory(int index, uint64_t sector,
+							uint64_t size, std::unordered_set<uint64_t> &seen);
+	bool				_Reclaim();
+	uint64_t			_SlotLocation(const Extent &extent) const;
+	bool				_Move(int index, uint64_t to);
+	void				_Throttle(uint64_t bytes);
+
+	RedSea *			mVolume;
+	uint64_t			mRootSector;
+	uint64_t			mRootSectors;
+	uint64_t			mThrottle;
+	uint64_t			mPosition;
+	uint64_t			mMovedBytes;
+	std::chrono::steady_clock::time_point mStarted;
+	bool				mScanned;
+	bool				mSane; // every entry found points into the volume
+	bool				mDone;
+	std::vector<Extent>	mExtents;
+	std::vector<int>	mOrder; // mExtents by ascending start
+	size_t				mNext; // first entry of mOrder not yet visited
+};
+
+#endif
@@ -0,0 +1,245 @@
+#include "extentmap.h"
+
+#include "bitmap.h"
+
+
+void
+RedSeaExtentMap::Build(const uint8_t *map, uint64_t bits)
+{
+	mByOffset.clear();
+	mBySize.clear();
+	mFreeCount = 0;
+
+	uint64_t position = 0;
+	while (position < bits) {
+		uint64_t start = bitmap_find_clear_run(map, bits, position, 1);
+		if (start == BITMAP_NOT_FOUND)
+			break;
+		uint64_t end = bitmap_find_set(map, bits, start);
+		_Add(start, end - start);
+		position = end;
+	}
+}
+
+
+void
+RedSeaExtentMap::Insert(uint64_t start, uint64_t length)
+{
+	if (length == 0)
+		return;
+
+	uint64_t end = start + length;
+
+	// merge with every run that overlaps or touches [start, end)
+	OffsetMap::iterator extent = mByOffset.upper_bound(start);
+	if (extent != mByOffset.begin()) {
+		OffsetMap::iterator previous = extent;
+		previous--;
+		if (previous->first + previous->second >= start)
+			extent = previous;
+	}
+
+	while (extent != mByOffset.end() && extent->first <= end) {
+		if (extent->first < start)
+			start = extent->first;
+		if (extent->first + extent->second > end)
+			end = extent->first + extent->second;
+		OffsetMap::iterator next = extent;
+		next++;
+		_Erase(extent);
+		extent = next;
+	}
+
+	_Add(start, end - start);
+}
+
+
+void
+RedSeaExtentMap::Remove(uint64_t start, uint64_t length)
+{
+	if (length == 0)
+		return;
+
+	uint64_t end = start + length;
+
+	OffsetMap::iterator extent = mByOffset.upper_bound(start);
+	if (extent != mByOffset.begin()) {
+		OffsetMap::iterator previous = extent;
+		previous--;
+		if (previous->first + previous->second > start)
+			extent = previous;
+	}
+
+	while (extent != mByOffset.end() && extent->first < end) {
+		uint64_t extentStart = extent->first;
+		uint64_t extentEnd = extent->first + extent->second;
+		OffsetMap::iterator next = extent;
+		next++;
+		_Erase(extent);
+
+		if (extentStart < start)
+			_Add(extentStart, start - extentStart);
+		if (extentEnd > end)
+			_Add(end, extentEnd - end);
+		extent = next;
+	}
+}
+
+
+bool
+RedSeaExtentMap::Contains(uint64_t start, uint64_t length) const
+{
+	OffsetMap::const_iterator extent = mByOffset.upper_bound(start);
+	if (extent == mByOffset.begin())
+		return false;
+	extent--;
+	return extent->first + extent->second >= start + length;
+}
+
+
+uint64_t
+RedSeaExtentMap::FindFirst(uint64_t length) const
+{
+	if (LargestExtent() < length)
+		return EXTENT_NOT_FOUND;
+
+	OffsetMap::const_iterator extent = mByOffset.begin();
+	for (; extent != mByOffset.end(); extent++) {
+		if (extent->second >= length)
+			return extent->first;
+	}
+	return EXTENT_NOT_FOUND;
+}
+
+
+uint64_t
+RedSeaExtentMap::FindEndingAt(uint64_t end) const
+{
+	OffsetMap::const_iterator extent = mByOffset.lower_bound(end);
+	if (extent == mByOffset.begin())
+		return EXTENT_NOT_FOUND;
+	extent--;
+	if (extent->first + extent->second != end)
+		return EXTENT_NOT_FOUND;
+	return extent->first;
+}
+
+
+uint64_t
+RedSeaExtentMap::FindBest(uint64_t length) const
+{
+	SizeSet::const_iterator extent
+		= mBySize.lower_bound(std::make_pair(length, (uint64_t)0));
+	if (extent == mBySize.end())
+		return EXTENT_NOT_FOUND;
+	return extent->second;
+}
+
+
+uint64_t
+RedSeaExtentMap::FindNext(uint64_t length, uint64_t cursor) const
+{
+	if (LargestExtent() < length)
+		return EXTENT_NOT_FOUND;
+
+	// the run containing the cursor may still have room behind it
+	OffsetMap::const_iterator extent = mByOffset.upper_bound(cursor);
+	if (extent != mByOffset.begin()) {
+		OffsetMap::const_iterator previous = extent;
+		previous--;
+		if (previous->first + previous->second >= cursor + length)
+			return cursor > previous->first ? cursor : previous->first;
+	}
+
+	for (; extent != mByOffset.end(); extent++) {
+		if (extent->second >= length)
+			return extent->first;
+	}
+	for (extent = mByOffset.begin(); extent != mByOffset.end()
+			&& extent->first < cursor; extent++) {
+		if (extent->second >= length)
+			return extent->first;
+	}
+	return EXTENT_NOT_FOUND;
+}
+
+
+uint64_t
+RedSeaExtentMap::FindNear(uint64_t length, uint64_t position) const
+{
+	if (LargestExtent() < length)
+		return EXTENT_NOT_FOUND;
+
+	// Walk outwards in both directions at once, so the search stops at the
+	// first fit on either side instead of scanning to the end of the map.
+	OffsetMap::const_iterator after = mByOffset.upper_bound(position);
+	OffsetMap::const_iterator before = after;
+	if (before != mByOffset.begin()) {
+		before--;
+		// the run containing the position may have room behind it
+		if (before->first + before->second >= position + length)
+			return position;
+	}
+
+	bool backward = after != mByOffset.begin();
+	while (after != mByOffset.end() || backward) {
+		uint64_t forwardDistance = UINT64_MAX;
+		if (after != mByOffset.end())
+			forwardDistance = after->first - position;
+		uint64_t backwardDistance = UINT64_MAX;
+		if (backward) {
+			uint64_t end = before->first + before->second;
+			backwardDistance = end < position ? position - end : 0;
+		}
+
+		if (forwardDistance <= backwardDistance) {
+			if (after->second >= length)
+				return after->first;
+			after++;
+		} else {
+			if (before->second >= length)
+				return before->first + before->second - length;
+			if (before == mByOffset.begin())
+				backward = false;
+			else
+				before--;
+		}
+	}
+	return EXTENT_NOT_FOUND;
+}
+
+
+uint64_t
+RedSeaExtentMap::LargestExtent() const
+{
+	if (mBySize.empty())
+		return 0;
+	return mBySize.rbegin()->first;
+}
+
+
+uint64_t
+RedSeaExtentMap::FindLargest(uint64_t length) const
+{
+	if (LargestExtent() < length)
+		return EXTENT_NOT_FOUND;
+	return mBySize.rbegin()->second;
+}
+
+
+void
+RedSeaExtentMap::_Add(uint64_t start, uint64_t length)
+{
+	mByOffset[start] = length;
+	mBySize.insert(std::make_pair(length, start));
+	mFreeCount += length;
+}
+
+
+void
+RedSeaExtentMap::_Erase(OffsetMap::iterator extent)
+{
+	mFreeCount -= extent->second;
+	mBySize.erase(std::make_pair(extent->second, extent->first));
+	mByOffset.erase(extent);
+}
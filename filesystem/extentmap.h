@@ -0,0 +1,51 @@
+#ifndef REDSEA_EXTENTMAP_H
+#define REDSEA_EXTENTMAP_H
+
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <utility>
+
+#define EXTENT_NOT_FOUND	UINT64_MAX
+
+// In-memory index of the free runs in the allocation bitmap, kept both by
+// start and by length. Positions and lengths are bitmap bits, not sectors.
+class RedSeaExtentMap {
+public:
+						RedSeaExtentMap() : mFreeCount(0) {}
+	void				Build(const uint8_t *map, uint64_t bits);
+	void				Insert(uint64_t start, uint64_t length);
+	void				Remove(uint64_t start, uint64_t length);
+	bool				Contains(uint64_t start, uint64_t length) const;
+
+	// lowest free run that fits; linear in the number of free runs
+	uint64_t			FindFirst(uint64_t length) const;
+	// smallest free run that fits, lowest one on ties; logarithmic
+	uint64_t			FindBest(uint64_t length) const;
+	// first fit at or after "cursor", wrapping around once
+	uint64_t			FindNext(uint64_t length, uint64_t cursor) const;
+	// fitting run that lies closest to "position", placed at the near end
+	// of it; linear in the number of free runs passed over
+	uint64_t			FindNear(uint64_t length, uint64_t position) const;
+	// start of the free run ending right at "end"; logarithmic
+	uint64_t			FindEndingAt(uint64_t end) const;
+
+	uint64_t			CountExtents() const { return mByOffset.size(); }
+	uint64_t			FreeCount() const { return mFreeCount; }
+	uint64_t			LargestExtent() const;
+	// start of the largest free run
+	uint64_t			FindLargest(uint64_t length) const;
+private:
+	typedef std::map<uint64_t, uint64_t> OffsetMap;
+	typedef std::set<std::pair<uint64_t, uint64_t> > SizeSet;
+
+	void				_Add(uint64_t start, uint64_t length);
+	void				_Erase(OffsetMap::iterator extent);
+
+	OffsetMap			mByOffset; // start -> length
+	SizeSet				mBySize; // (length, start)
+	uint64_t			mFreeCount;
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "redsea.h"
+#include "bitmap.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,229 +7,559 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
-#include <OS.h>
+
+#include <vector>
 
 RSEntryPointer gInvalidPointer = { UINT64_MAX, NULL };
 
+// Upper bound for a single device request; larger transfers are split.
+#define RS_DEFAULT_MAX_TRANSFER	(1024 * 1024)
+#define RS_DEFAULT_CACHE_SIZE	(8 * 1024 * 1024)
+// Requests of at least this size go to the device directly.
+#define RS_CACHE_BYPASS			(64 * 1024)
+// Smallest cache kept for a device that needs aligned transfers.
+#define RS_MIN_ALIGNED_CACHE	(256 * 1024)
+// Most pieces of a split transfer handed to the device at once.
+#define RS_MAX_BATCH			64
+// Bounds of the read-ahead window, which doubles while reads stay sequential.
+#define RS_READAHEAD_MIN		(128 * 1024)
+#define RS_READAHEAD_MAX		(4 * 1024 * 1024)
+// Most sectors a growing file gets reserved past its end (64 MiB).
+#define RS_MAX_RESERVATION		131072
+// Largest file whose allocation is delayed; growing past it commits.
+#define RS_MAX_DELAYED			(8 * 1024 * 1024)
+// Unit in which file data is copied when a file has to move.
+#define RS_COPY_CHUNK			(1024 * 1024)
+
 RedSea::RedSea(int f)
 {
-	debugger("init");
-	mFile = f;
-	Read(0, 0x200, &mBoot);
+	mDevice = new RedSeaFileDevice(f);
+	_Init();
+}
 
-	if (mBoot.signature != 0x88 || mBoot.signature2 != 0xAA55) {
-		mIsValid = false;
-		return;
+
+RedSea::RedSea(RedSeaDevice *device)
+{
+	mDevice = device;
+	_Init();
+}
+
+
+RedSea::~RedSea()
+{
+	if (mIsValid) {
+		// whatever callers did not sync themselves is not to be lost
+		_Sync();
+		if (!mBitmapMapped)
+			delete[] mBitmapSectors;
+		delete[] mBitmapDirty;
 	}
+	delete mCache;
+	delete mDevice;
+}
+
+
+void
+RedSea::_Init()
+{
+	mMaxTransfer = RS_DEFAULT_MAX_TRANSFER;
+	mCache = NULL;
+	mSyncing = false;
+	mIsValid = false;
+
+	// there is no cache to stage an unaligned read through yet
+	uint32_t alignment = mDevice->Alignment() > 0x200
+		? mDevice->Alignment() : 0x200;
+	void *boot;
+	if (posix_memalign(&boot, alignment, alignment) != 0)
+		return;
+	bool haveBoot = _ReadDirect(0, alignment, boot) >= sizeof(mBoot);
+	memcpy(&mBoot, boot, sizeof(mBoot));
+	free(boot);
+
+	if (!haveBoot || mBoot.signature != 0x88 || mBoot.signature2 != 0xAA55)
+		return;
 	
 	mIsValid = true;
+	SetCacheSize(RS_DEFAULT_CACHE_SIZE);
 
 	mBitmapLength = mBoot.bitmap_sectors * 0x200;
-	mBitmapSectors = new uint8_t[mBitmapLength];
-	uint64_t readbytes = Read(0x200, mBitmapLength, mBitmapSectors);
-	if (readbytes != mBitmapLength) {
-		mIsValid = false;
-		delete[] mBitmapSectors;
+
+	// A writable mapping lets the bitmap be changed in place, no copy needed.
+	mBitmapMapped = mDevice->Mapping() != NULL && !mDevice->IsReadOnly()
+		&& mDevice->MappingSize() >= 0x200 + mBitmapLength;
+	if (mBitmapMapped)
+		mBitmapSectors = mDevice->Mapping() + 0x200;
+	else {
+		mBitmapSectors = new uint8_t[mBitmapLength];
+		uint64_t readbytes = Read(0x200, mBitmapLength, mBitmapSectors);
+		if (readbytes != mBitmapLength) {
+			mIsValid = false;
+			delete[] mBitmapSectors;
+			return;
+		}
 	}
-}
 
+	// The bitmap has to cover the whole volume, and the root directory has
+	// to lie inside it and be allocated. Bits past the end of the volume
+	// are never handed out.
+	uint64_t first = mBoot.bitmap_sectors + 1;
+	uint64_t root = mBoot.root_sector - mBoot.base_offset;
+	if (mBoot.count <= first || mBoot.count - first > mBitmapLength * 8
+		|| root < first || root >= mBoot.count
+		|| bitmap_is_clear(mBitmapSectors, root - first, 1)) {
+		mIsValid = false;
+		if (!mBitmapMapped)
+			delete[] mBitmapSectors;
+		return;
+	}
 
-const uint64_t m1  = (uint64_t)0x5555555555555555LL;
-const uint64_t m2  = (uint64_t)0x3333333333333333LL;
-const uint64_t m4  = (uint64_t)0x0f0f0f0f0f0f0f0fLL;
-const uint64_t h01 = (uint64_t)0x0101010101010101LL;
+	mFreeExtents.Build(mBitmapSectors, mBoot.count - first);
+	mAllocationPolicy = RS_ALLOCATE_BEST_FIT;
+	mNextFitCursor = 0;
 
-int popcount(uint64_t x) {
-    x -= (x >> 1) & m1;
-    x = (x & m2) + ((x >> 2) & m2);
-    x = (x + (x >> 4)) & m4;
-    return (x * h01) >> 56;
+	mBitmapDirty = new uint8_t[(mBoot.bitmap_sectors + 7) / 8]();
+	mDeferBitmapFlush = true;
 }
 
 
-int
+uint64_t
 RedSea::UsedClusters()
 {
-	int result = 0;
-	for (int i = 0; i < mBitmapLength; i++)
-		result += popcount(mBitmapSectors[i]);
-	result += mBitmapLength + 1;
-	return result;
+	// the boot sector and the bitmap itself are never free
+	mAllocationLocker.lock();
+	uint64_t used = mBoot.count - mFreeExtents.FreeCount();
+	mAllocationLocker.unlock();
+	return used;
 }
 
+
+// Returns the first bitmap bit of a free run of "count" sectors according
+// to the allocation policy, close to sector "near" if that is wanted. Must be called with mAllocationLocker held.
 uint64_t
-RedSea::FirstFreeSector(int count)
+RedSea::_FindFree(uint64_t count, uint64_t near)
 {
-	int i;
-	uint64_t start = UINT64_MAX;
-	int ccount = 0;
-	for (i = 0; i < mBitmapLength; i++) {
-		int bi, ci;
-		for (bi = 1, ci = 0; ci < 8; bi <<= 1, ci++) {
-			if ((mBitmapSectors[i] & bi) == 0) {
-				if (start == UINT64_MAX) {
-					start = (i << 3) | ci;
-					start += mBoot.bitmap_sectors + 1;
-				}
-				ccount++;
-				if (ccount >= count)
-					return start;
-			} else {
-				if (ccount >= count)
-					return start;
-				start = ~0;
-			}
-		}
-	}
-
-	if (ccount >= count)
-		return start;
+	if (count == 0)
+		count = 1;
 
-	return ~0;
+	uint64_t first = mBoot.bitmap_sectors + 1;
+	switch (mAllocationPolicy) {
+		case RS_ALLOCATE_NEAR_PARENT:
+			if (near >= first)
+				return mFreeExtents.FindNear(count, near - first);
+			// new directories start out with the most room behind them
+			return mFreeExtents.FindLargest(count);
+		case RS_ALLOCATE_BEST_FIT:
+			return mFreeExtents.FindBest(count);
+		case RS_ALLOCATE_NEXT_FIT:
+			return mFreeExtents.FindNext(count, mNextFitCursor);
+		default:
+			return mFreeExtents.FindFirst(count);
+	}
 }
 
 
 uint64_t
-RedSea::Allocate(int count)
+RedSea::FirstFreeSector(int count)
 {
-	uint64_t firstFree = FirstFreeSector(count);
-	if (firstFree == UINT64_MAX)
-		return firstFree;
+	mAllocationLocker.lock();
+	uint64_t bit = _FindFree(count);
+	mAllocationLocker.unlock();
+	if (bit == EXTENT_NOT_FOUND)
+		return ~0;
 
-	uint64_t start = firstFree;
-	start -= mBoot.bitmap_sectors + 1;
+	return bit + mBoot.bitmap_sectors + 1;
+}
 
-	uint64_t end = start + count - 1; // inclusive!
 
-	int startbit = start % 8;
-	int endbit = end % 8;
+void
+RedSea::SetAllocationPolicy(int policy)
+{
+	mAllocationLocker.lock();
+	mAllocationPolicy = policy;
+	mAllocationLocker.unlock();
+}
 
-	start >>= 3;
-	end >>= 3;
 
-	if (start == end) {
-		for (int i = startbit; i <= endbit; i++) {
-			mBitmapSectors[start] |= (1 << i);
-		}
-	} else {
-		if (startbit == 0) {
-			mBitmapSectors[start] = 0xFF;
-		} else {
-			for (int i = startbit; i < 8; i++) {
-				mBitmapSectors[start] |= 1 << i;
-			}
-		}
+int
+RedSea::AllocationPolicyFor(const char *name)
+{
+	static const char *kNames[] = { "first", "best", "next", "near" };
+	for (int i = 0; i < (int)(sizeof(kNames) / sizeof(kNames[0])); i++) {
+		if (strcmp(name, kNames[i]) == 0)
+			return RS_ALLOCATE_FIRST_FIT + i;
+	}
+	return -1;
+}
 
-		if (endbit == 0) {
-			memset(mBitmapSectors + start + 1, 0xFF, end - start + 1);
-		} else {
-			memset(mBitmapSectors + start + 1, 0xFF, end - start);
-			for (int i = 0; i <= endbit; i++) {
-				mBitmapSectors[end] |= 1 << i;
-			}
-		}
+
+uint64_t
+RedSea::Allocate(int count, uint64_t near, uint64_t reserve)
+{
+	if (count == 0)
+		count = 1;
+
+	mAllocationLocker.lock();
+	uint64_t bit = _FindFree(count + reserve, near);
+	if (bit == EXTENT_NOT_FOUND) {
+		mAllocationLocker.unlock();
+		return UINT64_MAX;
 	}
 
-	return firstFree;
+	bitmap_set_range(mBitmapSectors, bit, count);
+	mFreeExtents.Remove(bit, count + reserve);
+	_MarkBitmapDirty(bit, count);
+	mNextFitCursor = bit + count + reserve;
+	mAllocationLocker.unlock();
+
+	return bit + mBoot.bitmap_sectors + 1;
 }
 
 
 void
 RedSea::Deallocate(uint64_t start, int count)
 {
-	start -= mBoot.bitmap_sectors + 1;
-
 	if (count == 0)
 		count = 1;
 
-	uint64_t end = start + count - 1; // inclusive!
+	start -= mBoot.bitmap_sectors + 1;
 
-	int startbit = start % 8;
-	int endbit = end % 8;
+	mAllocationLocker.lock();
+	bitmap_clear_range(mBitmapSectors, start, count);
+	mFreeExtents.Insert(start, count);
+	_MarkBitmapDirty(start, count);
+	mAllocationLocker.unlock();
+}
 
-	start >>= 3;
-	end >>= 3;
 
-	if (start == end) {
-		for (int i = startbit; i <= endbit; i++) {
-			mBitmapSectors[start] &= ~(1 << i);
-		}
-	} else {
-		if (startbit == 0) {
-			mBitmapSectors[start] = 0x00;
-		} else {
-			for (int i = startbit; i < 8; i++) {
-				mBitmapSectors[start] &= ~(1 << i);
-			}
-		}
+bool
+RedSea::IsFree(uint64_t sector, uint64_t count)
+{
+	sector -= mBoot.bitmap_sectors + 1;
 
-		if (endbit == 0) {
-			memset(mBitmapSectors + start + 1, 0x00, end - start + 1);
-		} else {
-			memset(mBitmapSectors + start + 1, 0x00, end - start);
-			for (int i = 0; i <= endbit; i++) {
-				mBitmapSectors[end] &= ~(1 << i);
-			}
-		}
-	}
+	mAllocationLocker.lock();
+	bool free = mFreeExtents.Contains(sector, count);
+	mAllocationLocker.unlock();
+	return free;
+}
+
+
+uint64_t
+RedSea::FreeBefore(uint64_t sector)
+{
+	uint64_t first = mBoot.bitmap_sectors + 1;
+
+	mAllocationLocker.lock();
+	uint64_t start = mFreeExtents.FindEndingAt(sector - first);
+	mAllocationLocker.unlock();
+	return start == EXTENT_NOT_FOUND ? sector : start + first;
+}
+
+
+void
+RedSea::ForceAllocate(uint64_t sector, uint64_t count)
+{
+	sector -= mBoot.bitmap_sectors + 1;
+
+	mAllocationLocker.lock();
+	bitmap_set_range(mBitmapSectors, sector, count);
+	mFreeExtents.Remove(sector, count);
+	_MarkBitmapDirty(sector, count);
+	mAllocationLocker.unlock();
 }
 
 
 bool
-RedSea::IsFree(uint64_t sector)
+RedSea::TryAllocateAt(uint64_t sector, uint64_t count, uint64_t reserve)
+{
+	sector -= mBoot.bitmap_sectors + 1;
+
+	mAllocationLocker.lock();
+	if (!mFreeExtents.Contains(sector, count + reserve)) {
+		mAllocationLocker.unlock();
+		return false;
+	}
+
+	bitmap_set_range(mBitmapSectors, sector, count);
+	mFreeExtents.Remove(sector, count + reserve);
+	_MarkBitmapDirty(sector, count);
+	mAllocationLocker.unlock();
+	return true;
+}
+
+
+// Puts reserved sectors into the bitmap; they are not free already.
+void
+RedSea::AllocateReserved(uint64_t sector, uint64_t count)
 {
+	if (count == 0)
+		return;
+
 	sector -= mBoot.bitmap_sectors + 1;
-	return mBitmapSectors[sector >> 3] & (1 << (sector % 8)) == 1;
+
+	mAllocationLocker.lock();
+	bitmap_set_range(mBitmapSectors, sector, count);
+	_MarkBitmapDirty(sector, count);
+	mAllocationLocker.unlock();
 }
 
 
 void
-RedSea::ForceAllocate(uint64_t sector)
+RedSea::ReleaseReserved(uint64_t sector, uint64_t count)
 {
+	if (count == 0)
+		return;
+
 	sector -= mBoot.bitmap_sectors + 1;
-	mBitmapSectors[sector >> 3] |= (1 << (sector % 8));
+
+	mAllocationLocker.lock();
+	mFreeExtents.Insert(sector, count);
+	mAllocationLocker.unlock();
+}
+
+
+void
+RedSea::_MarkBitmapDirty(uint64_t bit, uint64_t count)
+{
+	if (count == 0)
+		return;
+
+	uint64_t first = bit / (0x200 * 8);
+	uint64_t last = (bit + count - 1) / (0x200 * 8);
+	bitmap_set_range(mBitmapDirty, first, last - first + 1);
+}
+
+
+static inline bool
+is_aligned(uint64_t location, uint64_t count, const void *buffer,
+	uint32_t alignment)
+{
+	return alignment <= 1
+		|| ((location | count | (uintptr_t)buffer) & (alignment - 1)) == 0;
+}
+
+
+// Writes back the bitmap sectors changed since the last flush, one request
+// per run of adjacent dirty sectors.
+bool
+RedSea::_FlushBitmap()
+{
+	uint64_t sectors = mBoot.bitmap_sectors;
+	bool success = true;
+
+	mAllocationLocker.lock();
+	if (mBitmapMapped) {
+		// the changes already are in the mapping
+		bitmap_clear_range(mBitmapDirty, 0, sectors);
+		mAllocationLocker.unlock();
+		return true;
+	}
+
+	// collect the dirty runs first, so that they can go out as one batch
+	std::vector<struct iovec> vecs;
+	std::vector<RedSeaIORequest> requests;
+	uint64_t start = bitmap_find_set(mBitmapDirty, sectors, 0);
+	while (start < sectors) {
+		uint64_t end = bitmap_find_clear_run(mBitmapDirty, sectors, start, 1);
+		if (end == BITMAP_NOT_FOUND)
+			end = sectors;
+
+		struct iovec vec = { mBitmapSectors + start * 0x200,
+			(size_t)(end - start) * 0x200 };
+		vecs.push_back(vec);
+		RedSeaIORequest request;
+		request.mLocation = 0x200 + start * 0x200;
+		request.mWrite = true;
+		request.mResult = -1;
+		requests.push_back(request);
+
+		start = bitmap_find_set(mBitmapDirty, sectors, end);
+	}
+
+	// with a block cache, the writes go through it instead
+	bool direct = mCache == NULL && !requests.empty();
+	for (size_t i = 0; i < requests.size(); i++) {
+		requests[i].mVecs = &vecs[i];
+		requests[i].mVecCount = 1;
+		if (vecs[i].iov_len > mMaxTransfer || !is_aligned(requests[i].mLocation,
+				vecs[i].iov_len, vecs[i].iov_base, mDevice->Alignment())) {
+			direct = false;
+		}
+	}
+	if (direct)
+		mDevice->Transfer(&requests[0], requests.size());
+
+	for (size_t i = 0; i < requests.size(); i++) {
+		uint64_t length = vecs[i].iov_len;
+		if ((uint64_t)requests[i].mResult == length
+			|| Write(requests[i].mLocation, length, vecs[i].iov_base)
+				== length) {
+			bitmap_clear_range(mBitmapDirty,
+				(requests[i].mLocation - 0x200) / 0x200, length / 0x200);
+		} else
+			success = false;
+	}
+	mAllocationLocker.unlock();
+
+	return success;
 }
 
 
 void
 RedSea::FlushBitmap()
 {
-	Write(0x200, mBitmapLength, mBitmapSectors);
+	if (!mDeferBitmapFlush)
+		_FlushBitmap();
+}
+
+
+// When deferred, which is the default, FlushBitmap() only leaves the
+// changes marked dirty; they are written on the next Sync().
+void
+RedSea::SetDeferBitmapFlush(bool defer)
+{
+	mDeferBitmapFlush = defer;
 }
 
 
 RedSeaDirEntry *
 RedSea::Create(RSEntryPointer pointer)
 {
-	uint16_t attributes;
-	Read(pointer.mLocation, 2, &attributes);
+	RSDirEntry entry;
+	if (pointer.mParent == NULL
+		|| !pointer.mParent->EntryAt(pointer.mLocation, &entry)) {
+		Read(pointer.mLocation, sizeof(RSDirEntry), &entry);
+	}
 
-	if (attributes & RS_ATTR_DIR) {
-		return new RedSeaDirectory(this, pointer.mLocation, pointer.mParent);
+	if (entry.mAttributes & RS_ATTR_DIR) {
+		return new RedSeaDirectory(this, pointer.mLocation, pointer.mParent,
+			entry);
 	} else {
-		return new RedSeaFile(this, pointer.mLocation, pointer.mParent);
+		return new RedSeaFile(this, pointer.mLocation, pointer.mParent, entry);
 	}
 }
 
 
+void
+RedSea::SetMaxTransferSize(uint64_t size)
+{
+	if (size < 0x200)
+		size = 0x200;
+	mMaxTransfer = size & ~(uint64_t)0x1FF;
+}
+
+
+void
+RedSea::SetCacheSize(uint64_t size)
+{
+	// a mapped device is its own cache
+	if (mDevice->Mapping() != NULL)
+		size = 0;
+
+	uint32_t blockSize = 0x1000;
+	if (mDevice->Alignment() > blockSize)
+		blockSize = mDevice->Alignment();
+
+	// unaligned transfers need the cache to be staged through
+	if (mDevice->Alignment() > 1 && size < RS_MIN_ALIGNED_CACHE)
+		size = RS_MIN_ALIGNED_CACHE;
+
+	if (size < blockSize) {
+		if (mCache != NULL) {
+			mCache->Sync();
+			delete mCache;
+			mCache = NULL;
+		}
+		return;
+	}
+
+	if (mCache == NULL)
+		mCache = new RedSeaBlockCache(this, mBoot.count * 0x200, size, blockSize);
+	else
+		mCache->SetBudget(size);
+}
+
+
+bool
+RedSea::Sync()
+{
+	std::unique_lock<std::mutex> lock(mSyncLocker);
+	if (mPendingSync == NULL)
+		mPendingSync = std::make_shared<SyncBatch>(SyncBatch{false, false});
+	std::shared_ptr<SyncBatch> batch = mPendingSync;
+
+	while (!batch->mDone) {
+		if (mSyncing) {
+			mSyncCondition.wait(lock);
+			continue;
+		}
+
+		// everyone who has joined the batch so far is covered by this sync
+		mSyncing = true;
+		mPendingSync.reset();
+		lock.unlock();
+		bool success = _Sync();
+		lock.lock();
+
+		batch->mSuccess = success;
+		batch->mDone = true;
+		mSyncing = false;
+		mSyncCondition.notify_all();
+	}
+	return batch->mSuccess;
+}
+
+
+// The bitmap goes out with the other dirty blocks, and then the device is
+// asked to make all of it durable.
+bool
+RedSea::_Sync()
+{
+	bool success = _FlushBitmap();
+	if (mCache != NULL && !mCache->Sync())
+		success = false;
+	if (!mDevice->Sync())
+		success = false;
+	return success;
+}
+
+
+void
+RedSea::_Prefetch(uint64_t location, uint64_t count)
+{
+	if (mCache == NULL) {
+		mDevice->Prefetch(location, count);
+		return;
+	}
+
+	// never crowd out the blocks about to be read
+	if (count > mCache->Budget() / 4)
+		count = mCache->Budget() / 4;
+	if (count > 0)
+		mCache->Prefetch(location, count);
+}
+
+
 uint64_t
 RedSea::Read(uint64_t location, uint64_t count, void *result)
 {
-	mFileLocker.Lock();
-	lseek(mFile, location, SEEK_SET);
-	int64_t readbytes = 0;
-	while (count > 0) {
-		uint64_t toread = count >= 0x200 ? 0x200 : count;
-		uint64_t haveread = read(mFile, result, toread);
-		result = (void *) (((char *)result) + haveread);
-		readbytes += haveread;
-		count -= toread;
-		if (haveread != toread) {
-			mFileLocker.Unlock();
-			return readbytes;
-		}
+	// transfers the device cannot take are staged through cached blocks
+	if (mCache != NULL && (count < RS_CACHE_BYPASS
+			|| !is_aligned(location, count, result, mDevice->Alignment()))) {
+		return mCache->Read(location, count, result);
 	}
-	mFileLocker.Unlock();
+
+	// A dirty block could be written back and evicted between the device
+	// read and the overlay, so the range is written back first; what
+	// cannot be stays cached and is overlaid.
+	if (mCache != NULL)
+		mCache->Sync(location, count);
+
+	uint64_t readbytes = _ReadDirect(location, count, result);
+
+	// cached blocks that have not been written back yet are more recent
+	if (mCache != NULL)
+		mCache->Overlay(location, readbytes, result);
 	return readbytes;
 }
 
@@ -236,116 +567,467 @@ RedSea::Read(uint64_t location, uint64_t count, void *result)
 uint64_t
 RedSea::Write(uint64_t location, uint64_t count, const void *from)
 {
-	mFileLocker.Lock();
-	uint8_t *buffer = new uint8_t[count];
-	uint8_t *bpointer = buffer;
-	memcpy(buffer, from, count);
-
-	lseek(mFile, location, SEEK_SET);
-	int64_t writtenbytes = 0;
-	while (count > 0) {
-		uint64_t towrite = count >= 0x200 ? 0x200 : count;
-		uint64_t havewritten = write(mFile, buffer, towrite);
-		buffer += havewritten;
-		writtenbytes += havewritten;
-		count -= towrite;
-		if (havewritten != towrite) {
-			mFileLocker.Unlock();
-			delete[] bpointer;
-			int err = errno;
-			debugger(strerror(err));
+	if (mCache != NULL && (count < RS_CACHE_BYPASS
+			|| !is_aligned(location, count, from, mDevice->Alignment()))) {
+		return mCache->Write(location, count, from);
+	}
+
+	// Cached copies are updated both before and after the device write, so
+	// that neither a write-back nor a concurrent cache fill can leave stale
+	// data behind.
+	if (mCache != NULL)
+		mCache->Update(location, count, from);
+
+	uint64_t writtenbytes = _WriteDirect(location, count, from);
+
+	if (mCache != NULL)
+		mCache->Update(location, count, from);
+	return writtenbytes;
+}
+
+
+// Issues the mMaxTransfer sized pieces of a large transfer as batches, so
+// that devices able to run them concurrently can do so. Returns how much
+// was transferred without a gap; the caller finishes the rest one request
+// at a time.
+uint64_t
+RedSea::_TransferBatched(uint64_t location, uint64_t count, void *buffer,
+	bool write)
+{
+	uint8_t *data = (uint8_t *)buffer;
+	uint64_t done = 0;
+	while (count - done > mMaxTransfer) {
+		struct iovec vecs[RS_MAX_BATCH];
+		RedSeaIORequest requests[RS_MAX_BATCH];
+		int pieces = 0;
+		for (uint64_t offset = done; offset < count && pieces < RS_MAX_BATCH;
+				offset += mMaxTransfer, pieces++) {
+			vecs[pieces].iov_base = data + offset;
+			vecs[pieces].iov_len = count - offset < mMaxTransfer
+				? count - offset : mMaxTransfer;
+			requests[pieces].mLocation = location + offset;
+			requests[pieces].mVecs = &vecs[pieces];
+			requests[pieces].mVecCount = 1;
+			requests[pieces].mWrite = write;
+			requests[pieces].mResult = -1;
+		}
+
+		mDevice->Transfer(requests, pieces);
+		for (int i = 0; i < pieces; i++) {
+			if (requests[i].mResult > 0)
+				done += requests[i].mResult;
+			if ((size_t)requests[i].mResult != vecs[i].iov_len)
+				return done;
+		}
+	}
+	return done;
+}
+
+
+uint64_t
+RedSea::_ReadDirect(uint64_t location, uint64_t count, void *result)
+{
+	uint8_t *buffer = (uint8_t *)result;
+	uint64_t readbytes = _TransferBatched(location, count, result, false);
+	while (readbytes < count) {
+		uint64_t toread = count - readbytes;
+		if (toread > mMaxTransfer)
+			toread = mMaxTransfer;
+		ssize_t haveread = mDevice->ReadAt(location + readbytes,
+			buffer + readbytes, toread);
+		if (haveread < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (haveread == 0)
+			break; // end of device
+		readbytes += haveread;
+	}
+	return readbytes;
+}
+
+
+uint64_t
+RedSea::_WriteDirect(uint64_t location, uint64_t count, const void *from)
+{
+	const uint8_t *buffer = (const uint8_t *)from;
+	uint64_t writtenbytes = _TransferBatched(location, count, (void *)from,
+		true);
+	while (writtenbytes < count) {
+		uint64_t towrite = count - writtenbytes;
+		if (towrite > mMaxTransfer)
+			towrite = mMaxTransfer;
+		ssize_t havewritten = mDevice->WriteAt(location + writtenbytes,
+			buffer + writtenbytes, towrite);
+		if (havewritten < 0 && errno == EINTR)
+			continue;
+		if (havewritten <= 0) {
+			// errno tells the frontends why, they decide how to report it
+			if (havewritten == 0)
+				errno = ENOSPC;
 			return writtenbytes;
 		}
+		writtenbytes += havewritten;
 	}
-	delete[] bpointer;
-	mFileLocker.Unlock();
 	return writtenbytes;
 }
 
 
-RedSeaDateTime::RedSeaDateTime()
+// Appends [location, location + count) to a batch as requests of at most
+// mMaxTransfer bytes. Returns whether the device can take all of them as
+// they are.
+bool
+RedSea::_AddPieces(RedSeaIORequest *requests, struct iovec *vecs,
+	int *pieces, uint64_t location, uint64_t count, void *buffer, bool write)
+{
+	bool direct = true;
+	for (uint64_t offset = 0; offset < count; offset += mMaxTransfer) {
+		struct iovec &vec = vecs[*pieces];
+		vec.iov_base = (uint8_t *)buffer + offset;
+		vec.iov_len = count - offset < mMaxTransfer
+			? count - offset : mMaxTransfer;
+		RedSeaIORequest &request = requests[(*pieces)++];
+		request.mLocation = location + offset;
+		request.mVecs = &vec;
+		request.mVecCount = 1;
+		request.mWrite = write;
+		request.mResult = -1;
+		if (!is_aligned(request.mLocation, vec.iov_len, vec.iov_base,
+				mDevice->Alignment())) {
+			direct = false;
+		}
+	}
+	return direct;
+}
+
+
+// Copies between two disjoint ranges of the device, RS_COPY_CHUNK at a
+// time. On a regular file copy_file_range() keeps the data in the kernel;
+// otherwise, or if that fails, _CopyBuffered() takes over. Memory use is
+// bounded either way.
+bool
+RedSea::_Copy(uint64_t from, uint64_t to, uint64_t count)
+{
+	if (count == 0)
+		return true;
+
+	// The device has to be current for the source. Reading it in buffers,
+	// dirty blocks that could not be written back are overlaid.
+	bool synced = mCache == NULL || mCache->Sync(from, count);
+
+#ifdef __linux__
+	int fd = mDevice->FileDescriptor();
+	if (synced && fd >= 0 && mDevice->Alignment() <= 1
+		&& mDevice->Mapping() == NULL) {
+		// The kernel changes the device behind the cache, and a cached block
+		// the target shares with a neighbouring extent could be written back
+		// over the copy before it is refreshed. So only whole blocks are
+		// copied that way, and the edges go through the buffers.
+		uint64_t blockSize = mCache != NULL ? mCache->BlockSize() : 1;
+		// A range inside a single block has no whole block at all, so both
+		// ends are kept within the range.
+		uint64_t first = (to + blockSize - 1) / blockSize * blockSize - to;
+		if (first > count)
+			first = count;
+		uint64_t last = to + count - (to + count) % blockSize;
+		last = last > to + first ? last - to : first;
+		uint64_t done = 0;
+		// blocks the previous owner of the target left dirty go out first
+		if (first < last && (mCache == NULL
+				|| mCache->Sync(to + first, last - first))) {
+			done = first;
+			while (done < last) {
+				loff_t in = from + done;
+				loff_t out = to + done;
+				size_t length = last - done < RS_COPY_CHUNK
+					? last - done : RS_COPY_CHUNK;
+				ssize_t copied = copy_file_range(fd, &in, fd, &out, length, 0);
+				if (copied < 0 && errno == EINTR)
+					continue;
+				if (copied <= 0)
+					break; // not supported here, the buffers take over
+				done += copied;
+			}
+			// the cache has to be current for the target afterwards
+			if (mCache != NULL && done > first)
+				mCache->Refresh(to + first, done - first);
+		}
+		if (done > first) {
+			return _CopyBuffered(from, to, first)
+				&& _CopyBuffered(from + done, to + done, count - done);
+		}
+	}
+#endif
+
+	return _CopyBuffered(from, to, count);
+}
+
+
+// The next chunk is read into a second buffer in the same batch that
+// writes the current one.
+bool
+RedSea::_CopyBuffered(uint64_t from, uint64_t to, uint64_t count)
+{
+	uint64_t done = 0;
+	if (count == 0)
+		return true;
+
+	// the write of one chunk and the read of the next are one batch, so
+	// both have to fit into it
+	uint64_t chunkSize = RS_COPY_CHUNK;
+	if (chunkSize > mMaxTransfer * (RS_MAX_BATCH / 2))
+		chunkSize = mMaxTransfer * (RS_MAX_BATCH / 2);
+	if (chunkSize > count - done)
+		chunkSize = count - done;
+	uint64_t alignment = mDevice->Alignment() > 0x1000
+		? mDevice->Alignment() : 0x1000;
+	void *buffers[2] = { NULL, NULL };
+	if (posix_memalign(&buffers[0], alignment, chunkSize) != 0)
+		return false;
+	if (posix_memalign(&buffers[1], alignment, chunkSize) != 0) {
+		free(buffers[0]);
+		return false;
+	}
+
+	bool success = true;
+	int current = 0;
+	uint64_t length = chunkSize;
+	if (Read(from + done, length, buffers[current]) != length)
+		success = false;
+
+	while (success && done < count) {
+		uint64_t next = done + length;
+		uint64_t nextLength = count - next < chunkSize ? count - next : chunkSize;
+
+		struct iovec vecs[RS_MAX_BATCH];
+		RedSeaIORequest requests[RS_MAX_BATCH];
+		int pieces = 0;
+		bool direct = _AddPieces(requests, vecs, &pieces, to + done, length,
+			buffers[current], true);
+		if (!_AddPieces(requests, vecs, &pieces, from + next, nextLength,
+				buffers[1 - current], false)) {
+			direct = false;
+		}
+
+		if (direct) {
+			if (mCache != NULL)
+				mCache->Update(to + done, length, buffers[current]);
+			mDevice->Transfer(requests, pieces);
+			if (mCache != NULL)
+				mCache->Update(to + done, length, buffers[current]);
+		}
+
+		// what did not complete in the batch takes the regular path
+		for (int i = 0; i < pieces; i++) {
+			uint64_t location = requests[i].mLocation;
+			uint64_t pieceLength = vecs[i].iov_len;
+			void *buffer = vecs[i].iov_base;
+			if ((uint64_t)requests[i].mResult == pieceLength) {
+				if (!requests[i].mWrite && mCache != NULL)
+					mCache->Overlay(location, pieceLength, buffer);
+			} else if ((requests[i].mWrite
+					? Write(location, pieceLength, buffer)
+					: Read(location, pieceLength, buffer)) != pieceLength) {
+				success = false;
+			}
+		}
+
+		done = next;
+		length = nextLength;
+		current = 1 - current;
+	}
+
+	free(buffers[0]);
+	free(buffers[1]);
+	return success;
+}
+
+
+RedSeaDateTime::RedSeaDateTime()
+{
+
+}
+
+
+RedSeaDateTime::RedSeaDateTime(uint32_t days, uint32_t ticks)
+{
+	mDaysSinceChrist = days;
+	mTicks = ticks;
+}
+
+
+RedSeaDateTime::RedSeaDateTime(uint64_t value)
+{
+	mDaysSinceChrist = value >> 32;
+	mTicks = value & 0xFFFFFFFF;
+}
+
+
+RedSeaDirEntry::RedSeaDirEntry(RedSea *rs, uint64_t location, RedSeaDirectory *dir)
+{
+	rs->Read(location, sizeof(RSDirEntry), &mDirEntry);
+	mDirEntry.mCluster -= rs->BaseOffset();
+	mRedSea = rs;
+	mEntryLocation = location;
+	mDirectory = dir;
+	mReservedSectors = 0;
+}
+
+
+RedSeaDirEntry::RedSeaDirEntry(RedSea *rs, uint64_t location,
+	RedSeaDirectory *dir, const RSDirEntry &entry)
+{
+	mDirEntry = entry;
+	mDirEntry.mCluster -= rs->BaseOffset();
+	mRedSea = rs;
+	mEntryLocation = location;
+	mDirectory = dir;
+	mReservedSectors = 0;
+}
+
+
+RedSeaDirEntry::~RedSeaDirEntry()
 {
-
+	TrimReservation();
 }
 
 
-RedSeaDateTime::RedSeaDateTime(uint32_t days, uint32_t ticks)
+// Every entry occupies at least one sector, even when it is empty.
+static inline uint64_t
+sectors_for_size(uint64_t size)
 {
-	mDaysSinceChrist = days;
-	mTicks = ticks;
+	uint64_t sectors = (size + 0x1FF) / 0x200;
+	return sectors == 0 ? 1 : sectors;
 }
 
 
-RedSeaDateTime::RedSeaDateTime(uint64_t value)
+// First sector behind the extent of a directory entry.
+static inline uint64_t
+extent_end(const RSDirEntry &entry)
 {
-	mDaysSinceChrist = value >> 32;
-	mTicks = value & 0xFFFFFFFF;
+	return entry.mCluster + sectors_for_size(entry.mSize);
 }
 
 
-RedSeaDirEntry::RedSeaDirEntry(RedSea *rs, uint64_t location, RedSeaDirectory *dir)
+uint64_t
+RedSeaDirEntry::_AllocationHint() const
 {
-	rs->Read(location, sizeof(RSDirEntry), &mDirEntry);
-	mDirEntry.mCluster -= rs->BaseOffset();
-	mRedSea = rs;
-	mEntryLocation = location;
-	mDirectory = dir;
+	// data goes behind the table of the directory holding the entry
+	if (mDirectory == NULL)
+		return mDirEntry.mCluster;
+	return extent_end(mDirectory->mDirEntry);
 }
 
 
 bool
 RedSeaDirEntry::Resize(uint64_t preferred)
 {
-	uint64_t previousEndSector = mDirEntry.mCluster + (mDirEntry.mSize + 0x1FF) / 0x200;
-	uint64_t currentEndSector = mDirEntry.mCluster + (preferred + 0x1FF) / 0x200;
+	// the reservation runs from the end of the extent to allocatedEndSector
+	uint64_t usedEndSector = extent_end(mDirEntry);
+	uint64_t allocatedEndSector = usedEndSector + mReservedSectors;
+	uint64_t currentEndSector = mDirEntry.mCluster + sectors_for_size(preferred);
 
-	if (currentEndSector == previousEndSector) {// no new sectors needed!
+	if (preferred < mDirEntry.mSize) {
+		// Downsizing, which gives up the reservation as well
 		mDirEntry.mSize = preferred;
+		if (currentEndSector < usedEndSector) {
+			mRedSea->Deallocate(currentEndSector,
+				usedEndSector - currentEndSector);
+		}
+		mRedSea->ReleaseReserved(usedEndSector, mReservedSectors);
+		mReservedSectors = 0;
 		return true;
 	}
 
-	if (preferred < mDirEntry.mSize) {
-		// Downsizing
-		mDirEntry.mSize = preferred;
-		mRedSea->Deallocate(currentEndSector + 1, previousEndSector - currentEndSector);
-	} else {
-		uint64_t newsectors = currentEndSector - previousEndSector;
-		for (uint64_t i = previousEndSector + 1; i <= currentEndSector; i++) {
-			if (!mRedSea->IsFree(i)) {
-				if (IsDirectory())
-					return false; // other directories may point to this one, can't know which ones
-				
-				uint64_t sectors = mRedSea->Allocate(newsectors);
-				if (sectors == UINT64_MAX)
-					return false; // not enough space?
-
-				uint8_t *buffer = new uint8_t[mDirEntry.mSize];
-				uint64_t oldSize = mDirEntry.mSize;
-				mRedSea->Read(mDirEntry.mCluster * 0x200, mDirEntry.mSize, buffer);
-				mRedSea->Deallocate(mDirEntry.mCluster, (mDirEntry.mSize + 0x1FF) / 0x200);
-				mDirEntry.mCluster = sectors;
-				mDirEntry.mSize = preferred;
-				mRedSea->Write(mDirEntry.mCluster * 0x200, oldSize, buffer);
-				delete[] buffer;
-				return true;
-			}
-		}
-		
-		// All sectors are free, continue getting file
-		for (uint64_t i = previousEndSector + 1; i <= currentEndSector; i++) {
-			mRedSea->ForceAllocate(i);
+	if (currentEndSector <= allocatedEndSector) {// no new sectors needed!
+		if (currentEndSector > usedEndSector) {
+			mRedSea->AllocateReserved(usedEndSector,
+				currentEndSector - usedEndSector);
 		}
-
+		mReservedSectors = allocatedEndSector - currentEndSector;
 		mDirEntry.mSize = preferred;
+		return true;
 	}
-	
+
+	// Files that grow get as much room again to grow into, so that a
+	// sequence of appends only moves them a logarithmic number of times.
+	// The reservation is not part of the size on disk until it is used.
+	uint64_t reserve = 0;
+	if (!IsDirectory()) {
+		reserve = sectors_for_size(preferred);
+		if (reserve > RS_MAX_RESERVATION)
+			reserve = RS_MAX_RESERVATION;
+	}
+
+	uint64_t newsectors = currentEndSector - allocatedEndSector;
+	if (reserve == 0
+		|| !mRedSea->TryAllocateAt(allocatedEndSector, newsectors, reserve)) {
+		if (!mRedSea->TryAllocateAt(allocatedEndSector, newsectors))
+			return _Relocate(preferred, reserve);
+		reserve = 0;
+	}
+
+	// All sectors are ours, continue getting file
+	mRedSea->AllocateReserved(usedEndSector, mReservedSectors);
+	mReservedSectors = reserve;
+	mDirEntry.mSize = preferred;
+	return true;
+}
+
+
+// Moves the entry to a new extent large enough for "preferred" bytes, with
+// "reserve" sectors behind it if there is room for them.
+bool
+RedSeaDirEntry::_Relocate(uint64_t preferred, uint64_t reserve)
+{
+	if (IsDirectory())
+		return false; // other directories may point to this one, can't know which ones
+
+	uint64_t hint = _AllocationHint();
+	uint64_t count = sectors_for_size(preferred);
+	uint64_t sectors = mRedSea->Allocate(count, hint, reserve);
+	if (sectors == UINT64_MAX) {
+		reserve = 0;
+		sectors = mRedSea->Allocate(count, hint);
+	}
+	if (sectors == UINT64_MAX)
+		return false; // not enough space?
+
+	if (!mRedSea->_Copy(mDirEntry.mCluster * 0x200, sectors * 0x200,
+			mDirEntry.mSize)) {
+		mRedSea->Deallocate(sectors, count);
+		mRedSea->ReleaseReserved(sectors + count, reserve);
+		return false;
+	}
+	mRedSea->Deallocate(mDirEntry.mCluster, sectors_for_size(mDirEntry.mSize));
+	mRedSea->ReleaseReserved(extent_end(mDirEntry), mReservedSectors);
+	mDirEntry.mCluster = sectors;
+	mDirEntry.mSize = preferred;
+	mReservedSectors = reserve;
 	return true;
 }
 
+
+// Gives back the sectors reserved past the end of the file, e.g. when the
+// last writer closes it.
+void
+RedSeaDirEntry::TrimReservation()
+{
+	if (mReservedSectors == 0)
+		return;
+
+	mRedSea->ReleaseReserved(extent_end(mDirEntry), mReservedSectors);
+	mReservedSectors = 0;
+}
+
+
 void
 RedSeaDirEntry::Delete()
 {
-	mRedSea->Deallocate(mDirEntry.mCluster, (mDirEntry.mSize + 0x1FF) / 0x200);
+	mRedSea->Deallocate(mDirEntry.mCluster,
+		sectors_for_size(_StoredEntry().mSize));
+	TrimReservation();
 	mDirEntry.mAttributes |= RS_ATTR_DELETED;
 }
 
@@ -353,46 +1035,145 @@ RedSeaDirEntry::Delete()
 void
 RedSeaDirEntry::Flush()
 {
-	mDirEntry.mCluster += mRedSea->BaseOffset();
-	mRedSea->Write(mEntryLocation, sizeof(RSDirEntry), &mDirEntry);
-	mDirEntry.mCluster -= mRedSea->BaseOffset();
-	if (mDirectory)
-		mDirectory->Flush();
+	if (!IsDetached())
+		_WriteSlot(_StoredEntry());
+}
+
+
+void
+RedSeaDirEntry::Detach()
+{
+	if (IsDetached())
+		return;
+
+	RSDirEntry stored = _StoredEntry();
+	stored.mAttributes |= RS_ATTR_DELETED;
+	_WriteSlot(stored);
+	mEntryLocation = UINT64_MAX;
+	mDirectory = NULL;
+}
+
+
+void
+RedSeaDirEntry::_WriteSlot(RSDirEntry stored)
+{
+	stored.mCluster += mRedSea->BaseOffset();
+
+	// the parent's copy of the slot is kept current in place
+	if (mDirectory != NULL)
+		mDirectory->_WriteSlot(mEntryLocation, stored);
+	else
+		mRedSea->Write(mEntryLocation, sizeof(RSDirEntry), &stored);
 }
 
 
 void
 RedSeaDirEntry::LockRead()
 {
-	mReadLocker.Lock();
+	mLocker.lock_shared();
 }
 
 
 void
 RedSeaDirEntry::LockWrite()
 {
-	mWriteLocker.Lock();
+	mLocker.lock();
 }
 
 
 void
 RedSeaDirEntry::UnlockRead()
 {
-	mReadLocker.Unlock();
+	mLocker.unlock_shared();
 }
 
 
 void
 RedSeaDirEntry::UnlockWrite()
 {
-	mWriteLocker.Unlock();
+	mLocker.unlock();
 }
 
 
 RedSeaFile::RedSeaFile(RedSea *rs, uint64_t location, RedSeaDirectory *dir)
-	: RedSeaDirEntry(rs, location, dir)
+	: RedSeaDirEntry(rs, location, dir),
+	mDelayed(false)
+{
+
+}
+
+
+RedSeaFile::RedSeaFile(RedSea *rs, uint64_t location, RedSeaDirectory *dir,
+	const RSDirEntry &entry)
+	: RedSeaDirEntry(rs, location, dir, entry),
+	mDelayed(false)
+{
+
+}
+
+
+bool
+RedSeaFile::Resize(uint64_t preferred)
+{
+	if (mDelayed) {
+		if (preferred <= RS_MAX_DELAYED) {
+			mDelayedData.resize(preferred);
+			mDirEntry.mSize = preferred;
+			return true;
+		}
+		if (!CommitAllocation())
+			return false;
+	}
+	return RedSeaDirEntry::Resize(preferred);
+}
+
+
+void
+RedSeaFile::DelayAllocation()
 {
+	if (mDirEntry.mSize == 0)
+		mDelayed = true;
+}
+
+
+// Allocates the extent for the data gathered so far, in place after the
+// placeholder sector if there is room, and writes the data in one go.
+bool
+RedSeaFile::CommitAllocation()
+{
+	if (!mDelayed)
+		return true;
+
+	uint64_t size = mDirEntry.mSize;
+	mDelayed = false;
+	if (IsDeleted()) {
+		std::vector<uint8_t>().swap(mDelayedData);
+		return false;
+	}
+
+	mDirEntry.mSize = 0;
+	if (!RedSeaDirEntry::Resize(size)) {
+		mDelayed = true;
+		mDirEntry.mSize = size;
+		return false;
+	}
+	TrimReservation();
 
+	bool success = size == 0 || mRedSea->Write(mDirEntry.mCluster * 0x200,
+		size, mDelayedData.data()) == size;
+	std::vector<uint8_t>().swap(mDelayedData);
+	return success;
+}
+
+
+// Until it is committed, the entry keeps the empty placeholder on disk.
+RSDirEntry
+RedSeaFile::_StoredEntry() const
+{
+	RSDirEntry entry = mDirEntry;
+	if (mDelayed)
+		entry.mSize = 0;
+	return entry;
 }
 
 
@@ -403,6 +1184,10 @@ RedSeaFile::Read(uint64_t start, uint64_t count, void *result)
 		return UINT64_MAX;
 	if (start + count > mDirEntry.mSize)
 		count = mDirEntry.mSize - start;
+	if (mDelayed) {
+		memcpy(result, mDelayedData.data() + start, count);
+		return count;
+	}
 	return mRedSea->Read(start + (mDirEntry.mCluster * 0x200), count, result);
 }
 
@@ -414,36 +1199,115 @@ RedSeaFile::Write(uint64_t start, uint64_t count, const void *result)
 		return UINT64_MAX;
 	if (start + count > mDirEntry.mSize)
 		count = mDirEntry.mSize - start;
+	if (mDelayed) {
+		memcpy(mDelayedData.data() + start, result, count);
+		return count;
+	}
 	return mRedSea->Write(start + (mDirEntry.mCluster * 0x200), count, result);
 }
 
 
+// Called after reading [start, start + count) through an open file: once
+// reads are sequential, keeps at least half a window of the following data
+// on its way into the cache. Files are contiguous, so that data is always
+// the next part of the extent.
+void
+RedSeaFile::ReadAhead(RSReadAhead &state, uint64_t start, uint64_t count)
+{
+	uint64_t end = start + count;
+	std::unique_lock<std::mutex> lock(state.mLock);
+	if (start != state.mNext) {
+		state.mNext = end;
+		state.mAhead = end;
+		state.mWindow = 0;
+		return;
+	}
+
+	state.mNext = end;
+	// large reads bypass the cache
+	if (mDelayed || (mRedSea->mCache != NULL && count >= RS_CACHE_BYPASS))
+		return;
+	if (state.mAhead < end)
+		state.mAhead = end;
+	if (state.mAhead - end > state.mWindow / 2)
+		return;
+
+	if (state.mWindow == 0)
+		state.mWindow = RS_READAHEAD_MIN;
+	else if (state.mWindow < RS_READAHEAD_MAX)
+		state.mWindow *= 2;
+
+	uint64_t to = end + state.mWindow;
+	if (to > mDirEntry.mSize)
+		to = mDirEntry.mSize;
+	if (to <= state.mAhead)
+		return;
+
+	uint64_t from = state.mAhead;
+	state.mAhead = to;
+	lock.unlock();
+	mRedSea->_Prefetch(mDirEntry.mCluster * 0x200 + from, to - from);
+}
+
+
+// Clips [start, start + *count) to the file and writes back any cached
+// changes in it, so that the range can be read from the device descriptor
+// directly (e.g. spliced). Returns -1 if the device has no descriptor or
+// needs aligned transfers.
+int
+RedSeaFile::MapRead(uint64_t start, uint64_t *count, uint64_t *position)
+{
+	RedSeaDevice *device = mRedSea->mDevice;
+	int fd = device->FileDescriptor();
+	if (fd < 0 || device->Alignment() > 1 || mDelayed
+		|| start > mDirEntry.mSize) {
+		return -1;
+	}
+
+	if (start + *count > mDirEntry.mSize)
+		*count = mDirEntry.mSize - start;
+	*position = mDirEntry.mCluster * 0x200 + start;
+
+	if (mRedSea->mCache != NULL && !mRedSea->mCache->Sync(*position, *count))
+		return -1;
+	return fd;
+}
+
+
 RedSeaDirectory::RedSeaDirectory(RedSea *rs, uint64_t location, RedSeaDirectory *dir)
 	: RedSeaDirEntry(rs, location, dir),
-	mAttributes(0)
+	mLoadedEntries(0),
+	mEntries(NULL),
+	mEntriesMapped(false)
 {
-	mEntryCount = mDirEntry.mSize / 64;
+	Reload();
+}
 
-	Flush();
+
+RedSeaDirectory::RedSeaDirectory(RedSea *rs, uint64_t location,
+	RedSeaDirectory *dir, const RSDirEntry &entry)
+	: RedSeaDirEntry(rs, location, dir, entry),
+	mLoadedEntries(0),
+	mEntries(NULL),
+	mEntriesMapped(false)
+{
+	Reload();
 }
 
 
 int
 RedSeaDirectory::AddEntry(RedSeaDirEntry *entry)
 {
-	if (mEntryCount == mUsedEntries)
+	int j = _FreeSlot();
+	if (j < 0)
 		return -1;
-
-	int j;
-	for (j = 1; j < mEntryCount; j++) {
-		if ((mAttributes[j] & RS_ATTR_DELETED) || mAttributes[j] == 0) {
-			break;
-		}
-	}
 	
-	RSDirEntry &ent = entry->DirEntry();
+	RSDirEntry ent = entry->_StoredEntry();
 	
-	RedSeaDirEntry entr(mRedSea, mDirEntry.mCluster * 0x200 + j * 64, this);
+	uint64_t location = mDirEntry.mCluster * 0x200 + j * 64;
+	RSDirEntry previous;
+	EntryAt(location, &previous);
+	RedSeaDirEntry entr(mRedSea, location, this, previous);
 	RSDirEntry &nent = entr.DirEntry();
 	nent.mAttributes = ent.mAttributes;
 	strcpy(nent.mName, ent.mName);
@@ -459,10 +1323,8 @@ RedSeaDirectory::AddEntry(RedSeaDirEntry *entry)
 bool
 RedSeaDirectory::RemoveEntry(RedSeaDirEntry *entry)
 {
-	uint64_t location = entry->EntryLocation() - mDirEntry.mCluster * 0x200;
-	location /= 64;
-	
-	if (location > mEntryCount)
+	RSDirEntry stored;
+	if (!EntryAt(entry->EntryLocation(), &stored))
 		return false;
 	
 	entry->DirEntry().mAttributes |= RS_ATTR_DELETED;
@@ -470,47 +1332,275 @@ RedSeaDirectory::RemoveEntry(RedSeaDirEntry *entry)
 	return true;
 }
 
+
+// Moves "entry" into a slot of "target" under "name". The data stays where
+// it is; a moved directory gets its ".." entry pointed at the new parent.
+bool
+RedSeaDirectory::MoveEntry(RedSeaDirEntry *entry, RedSeaDirectory *target,
+	const char *name)
+{
+	RSDirEntry &ent = entry->DirEntry();
+	char oldName[sizeof(ent.mName)];
+	memcpy(oldName, ent.mName, sizeof(oldName));
+
+	if (!RemoveEntry(entry))
+		return false;
+	ent.mAttributes &= ~RS_ATTR_DELETED;
+	strncpy(ent.mName, name, sizeof(ent.mName) - 1);
+	ent.mName[sizeof(ent.mName) - 1] = '\0';
+
+	bool moved = true;
+	int slot = target->AddEntry(entry);
+	if (slot < 0) {
+		// no room over there, put it back
+		memcpy(ent.mName, oldName, sizeof(oldName));
+		target = this;
+		slot = AddEntry(entry);
+		if (slot < 0)
+			return false;
+		moved = false;
+	}
+
+	entry->mDirectory = target;
+	entry->mEntryLocation = target->mDirEntry.mCluster * 0x200 + slot * 64;
+
+	if (moved && target != this && entry->IsDirectory()) {
+		RedSeaDirEntry parent(mRedSea, ent.mCluster * 0x200 + 64,
+			(RedSeaDirectory *)entry);
+		RSDirEntry &pent = parent.DirEntry();
+		if (strncmp(pent.mName, "..", sizeof(pent.mName)) == 0) {
+			pent.mCluster = target->mDirEntry.mCluster;
+			pent.mSize = target->mDirEntry.mSize;
+			parent.Flush();
+		}
+	}
+	return moved;
+}
+
 void
-RedSeaDirectory::Flush()
+RedSeaDirectory::Reload()
 {
-	if (mAttributes)
-		delete[] mAttributes;
+	std::unique_lock<std::shared_mutex> lock(mTableLocker);
+	mEntryCount = mDirEntry.mSize / 64;
+
+	uint64_t location = mDirEntry.mCluster * 0x200;
+	uint64_t length = mEntryCount * sizeof(RSDirEntry);
+	RedSeaDevice *device = mRedSea->mDevice;
+
+	if (device->Mapping() != NULL && location + length <= device->MappingSize()) {
+		if (!mEntriesMapped)
+			delete[] mEntries;
+		mEntries = (RSDirEntry *)(device->Mapping() + location);
+		mEntriesMapped = true;
+		mLoadedEntries = mEntryCount;
+	} else {
+		if (mEntriesMapped || mEntries == NULL
+			|| mLoadedEntries != mEntryCount) {
+			if (!mEntriesMapped)
+				delete[] mEntries;
+			mEntries = new RSDirEntry[mEntryCount];
+			mEntriesMapped = false;
+			mLoadedEntries = mEntryCount;
+		}
+
+		uint64_t readbytes = mRedSea->Read(location, length, mEntries);
+		if (readbytes < length)
+			memset((uint8_t *)mEntries + readbytes, 0, length - readbytes);
+	}
 
-	mAttributes = new uint16_t[mEntryCount];
 	mUsedEntries = 0;
+	mNameIndex.clear();
 
 	for (int i = 1; i < mEntryCount; i++) {
-		uint64_t base = mDirEntry.mCluster * 0x200 + i * 64;
-		mRedSea->Read(base, 2, mAttributes + i);
-		if (mAttributes[i] != 0 && !(mAttributes[i] & RS_ATTR_DELETED)) {
+		if (_IsUsed(i)) {
 			mUsedEntries++;
+			_IndexName(mEntries[i].mName, i);
+		}
+	}
+}
+
+
+static inline std::string
+entry_name(const char *name)
+{
+	return std::string(name, strnlen(name, sizeof(((RSDirEntry *)0)->mName)));
+}
+
+
+// Returns the slot of this directory's table stored at "location", or -1.
+int
+RedSeaDirectory::_SlotFor(uint64_t location) const
+{
+	uint64_t start = mDirEntry.mCluster * 0x200;
+	if (location < start || (location - start) % sizeof(RSDirEntry) != 0)
+		return -1;
+
+	uint64_t slot = (location - start) / sizeof(RSDirEntry);
+	return slot < (uint64_t)mLoadedEntries ? (int)slot : -1;
+}
+
+
+// Writes a single slot of the table at "location" to disk, for the entry
+// stored there.
+void
+RedSeaDirectory::_WriteSlot(uint64_t location, const RSDirEntry &stored)
+{
+	std::unique_lock<std::shared_mutex> lock(mTableLocker);
+	int slot = _SlotFor(location);
+	RSDirEntry previous;
+	if (slot >= 0)
+		previous = mEntries[slot];
+	mRedSea->Write(location, sizeof(RSDirEntry), &stored);
+	if (slot >= 0)
+		_SlotChanged(slot, previous, stored);
+}
+
+
+// Brings the loaded table, the name index and the entry count up to date
+// after a single slot was written. Called with mTableLocker held.
+void
+RedSeaDirectory::_SlotChanged(int slot, const RSDirEntry &previous,
+	const RSDirEntry &current)
+{
+	// a mapped table already shows the new contents
+	if (!mEntriesMapped)
+		mEntries[slot] = current;
+
+	// slot 0 is the directory itself; most flushes only change the size
+	if (slot == 0 || (_IsUsed(previous) == _IsUsed(current)
+			&& strncmp(previous.mName, current.mName,
+				sizeof(current.mName)) == 0)) {
+		return;
+	}
+
+	if (_IsUsed(previous)) {
+		mUsedEntries--;
+		_UnindexName(previous.mName, slot);
+	}
+	if (_IsUsed(current)) {
+		mUsedEntries++;
+		_IndexName(current.mName, slot);
+	}
+}
+
+
+void
+RedSeaDirectory::_IndexName(const char *name, int slot)
+{
+	std::pair<std::unordered_map<std::string, int>::iterator, bool> result
+		= mNameIndex.insert(std::make_pair(entry_name(name), slot));
+	if (!result.second && slot < result.first->second)
+		result.first->second = slot;
+}
+
+
+void
+RedSeaDirectory::_UnindexName(const char *name, int slot)
+{
+	std::unordered_map<std::string, int>::iterator found
+		= mNameIndex.find(entry_name(name));
+	if (found == mNameIndex.end() || found->second != slot)
+		return;
+	mNameIndex.erase(found);
+
+	// fall back to a later entry of the same name, if there is one
+	for (int i = slot + 1; i < mEntryCount; i++) {
+		if (!_IsUsed(i))
+			continue;
+		if (strncmp(mEntries[i].mName, name, sizeof(mEntries[i].mName)) == 0) {
+			mNameIndex[entry_name(name)] = i;
+			break;
 		}
 	}
 }
 
+
+int
+RedSeaDirectory::FindEntry(const char *name)
+{
+	std::shared_lock<std::shared_mutex> lock(mTableLocker);
+	std::unordered_map<std::string, int>::iterator found
+		= mNameIndex.find(entry_name(name));
+	if (found == mNameIndex.end())
+		return -1;
+	return found->second;
+}
+
+
+RSEntryPointer
+RedSeaDirectory::Lookup(const char *name)
+{
+	int slot = FindEntry(name);
+	if (slot < 0)
+		return gInvalidPointer;
+
+	return (RSEntryPointer) { mDirEntry.mCluster * 0x200 + slot * 64, this };
+}
+
 RedSeaDirectory::~RedSeaDirectory()
 {
-	delete[] mAttributes;
+	if (!mEntriesMapped)
+		delete[] mEntries;
+}
+
+
+// Returns the first unused slot, or -1 if the directory is full. Slot 0 is
+// the directory's own entry.
+int
+RedSeaDirectory::_FreeSlot()
+{
+	std::shared_lock<std::shared_mutex> lock(mTableLocker);
+	for (int j = 1; j < mEntryCount; j++) {
+		if (!_IsUsed(j))
+			return j;
+	}
+	return -1;
+}
+
+
+// Copies the slot at "location" as loaded; false if it is not one of this
+// directory's.
+bool
+RedSeaDirectory::EntryAt(uint64_t location, RSDirEntry *entry)
+{
+	std::shared_lock<std::shared_mutex> lock(mTableLocker);
+	int slot = _SlotFor(location);
+	if (slot < 0)
+		return false;
+
+	*entry = mEntries[slot];
+	return true;
+}
+
+
+int
+RedSeaDirectory::CountEntries()
+{
+	std::shared_lock<std::shared_mutex> lock(mTableLocker);
+	return mUsedEntries;
 }
 
 
 RSEntryPointer
 RedSeaDirectory::GetEntry(int i)
 {
+	std::shared_lock<std::shared_mutex> lock(mTableLocker);
 	if (i >= mUsedEntries)
 		return gInvalidPointer;
 
 	int count = 0;
 	int j;
-	for (j = 1; count != i; j++) {
-		if (j > mEntryCount)
-			return gInvalidPointer;
-
-		if (mAttributes[j] != 0x0000 && !(mAttributes[j] & RS_ATTR_DELETED)) {
+	for (j = 1; j < mEntryCount; j++) {
+		if (_IsUsed(j)) {
+			if (count == i)
+				break;
 			count++;
 		}
 	}
 
+	if (j >= mEntryCount)
+		return gInvalidPointer;
+
 	i = j;
 
 	uint64_t base = mDirEntry.mCluster * 0x200 + i * 64;
@@ -519,6 +1609,28 @@ RedSeaDirectory::GetEntry(int i)
 }
 
 
+// Returns the first live entry at or after *slot and moves *slot past it.
+// Slots never move, so a cursor stays valid while entries come and go.
+RSEntryPointer
+RedSeaDirectory::NextEntry(int *slot)
+{
+	std::shared_lock<std::shared_mutex> lock(mTableLocker);
+	int j = *slot < 1 ? 1 : *slot;
+	for (; j < mEntryCount; j++) {
+		if (_IsUsed(j))
+			break;
+	}
+
+	if (j >= mEntryCount) {
+		*slot = mEntryCount;
+		return gInvalidPointer;
+	}
+
+	*slot = j + 1;
+	return (RSEntryPointer) { mDirEntry.mCluster * 0x200 + j * 64, this };
+}
+
+
 RSEntryPointer
 RedSeaDirectory::Self()
 {
@@ -529,13 +1641,15 @@ RedSeaDirectory::Self()
 RSEntryPointer
 RedSeaDirectory::CreateFile(const char *name, int size)
 {
-	if (mEntryCount == mUsedEntries) {
-		if (Resize(mDirEntry.mSize + 0x200)) {
-			mEntryCount = mDirEntry.mSize / 64;
-			Flush();
-		} else {
+	if (_FreeSlot() < 0) {
+		uint64_t oldSize = mDirEntry.mSize;
+		if (!Resize(oldSize + 0x200))
 			return gInvalidPointer;
-		}
+
+		char zerobuffer[0x200] = {0};
+		mRedSea->Write(mDirEntry.mCluster * 0x200 + oldSize, 0x200, zerobuffer);
+		RedSeaDirEntry::Flush();
+		Reload();
 	}
 
 	int sectors = (size + 0x1FF) / 0x200;
@@ -543,19 +1657,17 @@ RedSeaDirectory::CreateFile(const char *name, int size)
 	if (sectors == 0)
 		sectors = 1;
 
-	uint64_t location = mRedSea->Allocate(sectors);
+	uint64_t location = mRedSea->Allocate(sectors, extent_end(mDirEntry));
 
 	if (location == UINT64_MAX)
 		return gInvalidPointer;
 
-	int j;
-	for (j = 1; j < mEntryCount; j++) {
-		if ((mAttributes[j] & RS_ATTR_DELETED) || mAttributes[j] == 0) {
-			break;
-		}
-	}
+	int j = _FreeSlot();
 
-	RedSeaDirEntry ent(mRedSea, mDirEntry.mCluster * 0x200 + j * 64, this);
+	RSDirEntry previous;
+	EntryAt(mDirEntry.mCluster * 0x200 + j * 64, &previous);
+	RedSeaDirEntry ent(mRedSea, mDirEntry.mCluster * 0x200 + j * 64, this,
+		previous);
 	RSDirEntry &d = ent.DirEntry();
 	d.mAttributes = RS_ATTR_CONTIGUOUS;
 	strncpy(d.mName, name, 37);
@@ -571,7 +1683,8 @@ RedSeaDirectory::CreateFile(const char *name, int size)
 RSEntryPointer
 RedSeaDirectory::CreateDirectory(const char *name, int space)
 {
-	if (mEntryCount == mUsedEntries)
+	int j = _FreeSlot();
+	if (j < 0)
 		return gInvalidPointer;
 
 	char zerobuffer[0x200] = {0};
@@ -609,16 +1722,10 @@ RedSeaDirectory::CreateDirectory(const char *name, int space)
 	pent.mSize = mDirEntry.mSize;
 	parent.Flush();
 
-	int j;
-	for (j = 1; j < mEntryCount; j++) {
-		if ((mAttributes[j] & RS_ATTR_DELETED) || mAttributes[j] == 0) {
-			break;
-		}
-	}
-
-	mAttributes[j] = RS_ATTR_DIR | RS_ATTR_CONTIGUOUS;
-
-	RedSeaDirEntry child(mRedSea, mDirEntry.mCluster * 0x200 + j * 64, this);
+	RSDirEntry previous;
+	EntryAt(mDirEntry.mCluster * 0x200 + j * 64, &previous);
+	RedSeaDirEntry child(mRedSea, mDirEntry.mCluster * 0x200 + j * 64, this,
+		previous);
 
 	RSDirEntry &cent = child.DirEntry();
 	cent.mAttributes = RS_ATTR_DIR | RS_ATTR_CONTIGUOUS;
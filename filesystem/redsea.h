@@ -1,7 +1,17 @@
 #include <stdint.h>
 #include <stdio.h>
 
-#include <Locker.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "blockcache.h"
+#include "blockdevice.h"
+#include "extentmap.h"
 
 class RedSeaDirectory;
 class RedSeaDirEntry;
@@ -26,33 +36,118 @@ struct RSEntryPointer {
 
 extern RSEntryPointer gInvalidPointer;
 
+// Sequential read detection for one open file. Reads through the same
+// handle may run concurrently, so the state has a lock of its own.
+struct RSReadAhead {
+	RSReadAhead() : mNext(0), mAhead(0), mWindow(0) {}
+
+	std::mutex mLock;
+	uint64_t mNext; // where a sequential read would continue
+	uint64_t mAhead; // end of what has been prefetched
+	uint64_t mWindow;
+};
+
+enum {
+	RS_ALLOCATE_FIRST_FIT = 0,
+	RS_ALLOCATE_BEST_FIT,
+	RS_ALLOCATE_NEXT_FIT,
+	RS_ALLOCATE_NEAR_PARENT // close to the directory; directories spread out
+};
+
 class RedSea {
 public:
 				RedSea(int f);
+				RedSea(RedSeaDevice *device);
+				~RedSea();
 	RSEntryPointer		RootDirectory();
 	uint64_t			BaseOffset() { return mBoot.base_offset; }
 	uint64_t			FirstFreeSector(int count);
-	bool				IsFree(uint64_t sector);
-	void				ForceAllocate(uint64_t sector);
-	uint64_t			Allocate(int count);
+	bool				IsFree(uint64_t sector, uint64_t count = 1);
+	// First sector of the free run right below "sector", or "sector" if
+	// the one below is allocated.
+	uint64_t			FreeBefore(uint64_t sector);
+	void				ForceAllocate(uint64_t sector, uint64_t count = 1);
+	// Allocates "count" sectors at "sector" if they and the "reserve"
+	// sectors behind them are free, all under one lock hold.
+	bool				TryAllocateAt(uint64_t sector, uint64_t count,
+							uint64_t reserve = 0);
+	// "near" is a sector the allocation should be placed close to, if the
+	// policy cares; 0 for none. "reserve" more sectors behind the run are
+	// kept from other allocations.
+	uint64_t			Allocate(int count, uint64_t near = 0,
+							uint64_t reserve = 0);
 	void				Deallocate(uint64_t, int);
+	// Reserved sectors are only withheld in memory; the bitmap does not
+	// show them until they are allocated, so a crash cannot leak them.
+	void				AllocateReserved(uint64_t sector, uint64_t count);
+	void				ReleaseReserved(uint64_t sector, uint64_t count);
 	void				FlushBitmap();
+	void				SetDeferBitmapFlush(bool defer);
+	int					AllocationPolicy() const { return mAllocationPolicy; }
+	void				SetAllocationPolicy(int policy);
+	// "first", "best", "next" or "near"; -1 for anything else
+	static int			AllocationPolicyFor(const char *name);
 	bool				Valid() { return mIsValid; }
 	RSBoot &			BootStructure() { return mBoot; }
-	int					UsedClusters();
+	uint64_t			UsedClusters();
+	uint64_t			MaxTransferSize() const { return mMaxTransfer; }
+	void				SetMaxTransferSize(uint64_t size);
+	void				SetCacheSize(uint64_t size);
+	// Writes back all dirty state and makes it durable. Callers arriving
+	// while a sync is under way share the next one.
+	bool				Sync();
 	RedSeaDirEntry *	Create(RSEntryPointer);
 private:
 	friend class 		RedSeaDirEntry;
 	friend class 		RedSeaFile;
 	friend class 		RedSeaDirectory;
-	BLocker				mFileLocker;
+	friend class 		RedSeaBlockCache;
+	friend class 		RedSeaCompactor;
+	void				_Init();
 	bool				mIsValid;
-	int					mFile;
+	RedSeaDevice *		mDevice;
+	uint64_t			mMaxTransfer;
+	RedSeaBlockCache *	mCache;
 	RSBoot				mBoot;
 	uint8_t *			mBitmapSectors;
 	uint64_t			mBitmapLength;
+	bool				mBitmapMapped; // mBitmapSectors points into the device
+	// guards the bitmap and everything derived from it
+	std::mutex			mAllocationLocker;
+	RedSeaExtentMap		mFreeExtents;
+	uint8_t *			mBitmapDirty; // one bit per bitmap sector
+	bool				mDeferBitmapFlush;
+	struct SyncBatch {
+		bool			mDone;
+		bool			mSuccess;
+	};
+	std::mutex			mSyncLocker;
+	std::condition_variable mSyncCondition;
+	bool				mSyncing;
+	// the batch callers join until a sync for it starts
+	std::shared_ptr<SyncBatch> mPendingSync;
+	int					mAllocationPolicy;
+	uint64_t			mNextFitCursor;
+	uint64_t			_FindFree(uint64_t count, uint64_t near = 0);
+	void				_MarkBitmapDirty(uint64_t bit, uint64_t count);
+	bool				_FlushBitmap();
+	bool				_Sync();
+	void				_Prefetch(uint64_t location, uint64_t count);
 	uint64_t			Read(uint64_t location, uint64_t count, void *result);
 	uint64_t			Write(uint64_t location, uint64_t count, const void *from);
+	uint64_t			_ReadDirect(uint64_t location, uint64_t count,
+							void *result);
+	uint64_t			_WriteDirect(uint64_t location, uint64_t count,
+							const void *from);
+	bool				_Copy(uint64_t from, uint64_t to, uint64_t count);
+	bool				_CopyBuffered(uint64_t from, uint64_t to,
+							uint64_t count);
+	uint64_t			_TransferBatched(uint64_t location, uint64_t count,
+							void *buffer, bool write);
+	bool				_AddPieces(RedSeaIORequest *requests,
+							struct iovec *vecs, int *pieces,
+							uint64_t location, uint64_t count, void *buffer,
+							bool write);
 };
 
 class RedSeaDateTime {
@@ -82,49 +177,124 @@ struct RSDirEntry {
 class RedSeaDirEntry {
 public:
 					RedSeaDirEntry(RedSea *, uint64_t, RedSeaDirectory *);
+					RedSeaDirEntry(RedSea *, uint64_t, RedSeaDirectory *,
+						const RSDirEntry &);
+	virtual			~RedSeaDirEntry();
 	bool			IsDirectory() const { return mDirEntry.mAttributes & RS_ATTR_DIR; }
 	bool			IsFile() const { return !IsDirectory(); }
 	const char *	Name() const { return mDirEntry.mName; }
 	RSDirEntry &	DirEntry() { return mDirEntry; }
 	uint64_t		EntryLocation() const { return mEntryLocation; }
-	bool			Resize(uint64_t preferredSize);
+	virtual bool	Resize(uint64_t preferredSize);
+	void			TrimReservation();
 	void			Delete();
 	void			Flush();
+	// Removes the entry from its directory but keeps its extent, for an
+	// entry that is still in use after it was unlinked. Flush() does
+	// nothing from then on, as the slot may be reused; Delete() gives the
+	// extent back once the entry is done with.
+	void			Detach();
+	bool			IsDetached() const { return mEntryLocation == UINT64_MAX; }
+	bool			IsDeleted() const { return mDirEntry.mAttributes & RS_ATTR_DELETED; }
 	void			LockRead();
 	void			LockWrite();
 	void			UnlockRead();
 	void			UnlockWrite();
 protected:
-	BLocker mReadLocker;
-	BLocker mWriteLocker;
+	friend class RedSeaDirectory;
+	// the entry as it is to be written to the directory
+	virtual RSDirEntry	_StoredEntry() const { return mDirEntry; }
+	// sector new data of the entry is best placed near
+	uint64_t		_AllocationHint() const;
+	bool			_Relocate(uint64_t preferred, uint64_t reserve);
+	void			_WriteSlot(RSDirEntry stored);
+
+	// shared while reading the entry or its data, exclusive for changing
+	// either; not recursive
+	std::shared_mutex mLocker;
 	RedSeaDirectory *mDirectory;
 	RSDirEntry mDirEntry;
 	uint64_t mEntryLocation;
 	RedSea *mRedSea;
+	uint64_t mReservedSectors; // reserved past the end, not yet in mSize
 };
 
 class RedSeaFile : public RedSeaDirEntry {
 public:
 					RedSeaFile(RedSea *, uint64_t, RedSeaDirectory *);
+					RedSeaFile(RedSea *, uint64_t, RedSeaDirectory *,
+						const RSDirEntry &);
+	virtual bool	Resize(uint64_t preferredSize);
 	uint64_t		Read(uint64_t start, uint64_t count, void *result);
 	uint64_t		Write(uint64_t start, uint64_t count, const void *result);
+	int				MapRead(uint64_t start, uint64_t *count,
+						uint64_t *position);
+	void			ReadAhead(RSReadAhead &state, uint64_t start,
+						uint64_t count);
+	// Keeps the data of an empty file in memory, leaving it at its
+	// placeholder sector, until CommitAllocation() gives it an extent of
+	// the final size. The entry has to be flushed after committing, which
+	// is up to the owner before the file is destroyed. A deleted file's
+	// data is dropped instead, and false returned.
+	void			DelayAllocation();
+	bool			IsAllocationDelayed() const { return mDelayed; }
+	bool			CommitAllocation();
+protected:
+	virtual RSDirEntry	_StoredEntry() const;
 private:
+	bool			mDelayed;
+	std::vector<uint8_t> mDelayedData;
 };
 
 class RedSeaDirectory : public RedSeaDirEntry {
 public:
 						RedSeaDirectory(RedSea *, uint64_t, RedSeaDirectory *);
+						RedSeaDirectory(RedSea *, uint64_t, RedSeaDirectory *,
+							const RSDirEntry &);
 						~RedSeaDirectory();
-	int					CountEntries() { return mUsedEntries; }
+	int					CountEntries();
 	int					AddEntry(RedSeaDirEntry *);
 	RSEntryPointer		GetEntry(int i);
+	RSEntryPointer		NextEntry(int *slot);
+	int					FindEntry(const char *name);
+	RSEntryPointer		Lookup(const char *name);
+	bool				EntryAt(uint64_t location, RSDirEntry *entry);
 	RSEntryPointer		Self();
 	RSEntryPointer		CreateDirectory(const char *name, int space);
 	RSEntryPointer		CreateFile(const char *name, int size);
 	bool				RemoveEntry(RedSeaDirEntry *);
-	void				Flush();
+	bool				MoveEntry(RedSeaDirEntry *entry, RedSeaDirectory *target,
+							const char *name);
+	// Rereads the whole entry table. Entries flushed through their objects
+	// update their slot in place, so this is only needed when the table
+	// changes size or is written behind the directory's back.
+	void				Reload();
 protected:
+	friend class		RedSeaDirEntry;
+	static bool			_IsUsed(const RSDirEntry &entry)
+							{ return entry.mAttributes != 0
+								&& !(entry.mAttributes & RS_ATTR_DELETED); }
+	bool				_IsUsed(int slot) const
+							{ return _IsUsed(mEntries[slot]); }
+	int					_SlotFor(uint64_t location) const;
+	void				_WriteSlot(uint64_t location, const RSDirEntry &stored);
+	void				_SlotChanged(int slot, const RSDirEntry &previous,
+							const RSDirEntry &current);
+	int					_FreeSlot();
+	void				_IndexName(const char *name, int slot);
+	void				_UnindexName(const char *name, int slot);
+
+	// Guards the table, the index and the counts below. Entries write their
+	// slot under it while holding only their own lock, so it is never held
+	// while calling into another entry.
+	std::shared_mutex mTableLocker;
 	int mEntryCount;
 	int mUsedEntries;
-	uint16_t *mAttributes;
+	int mLoadedEntries;
+	// on-disk contents of the directory extent, loaded with a single read
+	// or, on a mapped device, used in place
+	RSDirEntry *mEntries;
+	bool mEntriesMapped;
+	// name -> slot of the first live entry with that name
+	std::unordered_map<std::string, int> mNameIndex;
 };
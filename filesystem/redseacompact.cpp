@@ -0,0 +1,93 @@
+// Linux tool: packs the files of an unmounted RedSea image towards its
+// start, so that free space coalesces behind them.
+//
+//	redseacompact [-r bytes/s] [-b bytes] [-s sector] <image>
+//
+// A run stopped by -b leaves a consistent image; it is continued by passing
+// the printed position to -s. A run interrupted in any other way is
+// continued the same way, and gives back the space of the move it was in
+// the middle of.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compactor.h"
+#include "redsea.h"
+
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [options] <image>\n\n", name);
+	fprintf(stderr,
+		"    -r BYTES    copy at most this many bytes per second\n"
+		"    -b BYTES    stop after moving about this many bytes\n"
+		"    -s SECTOR   resume at a position printed by an earlier run\n");
+}
+
+
+int
+main(int argc, char **argv)
+{
+	uint64_t rate = 0;
+	uint64_t budget = UINT64_MAX;
+	uint64_t position = 0;
+
+	int option;
+	while ((option = getopt(argc, argv, "r:b:s:h")) != -1) {
+		switch (option) {
+			case 'r':
+				rate = strtoull(optarg, NULL, 0);
+				break;
+			case 'b':
+				budget = strtoull(optarg, NULL, 0);
+				break;
+			case 's':
+				position = strtoull(optarg, NULL, 0);
+				break;
+			default:
+				usage(argv[0]);
+				return option == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const char *image = argv[optind];
+	int fd = open(image, O_RDWR);
+	if (fd < 0) {
+		perror(image);
+		return 1;
+	}
+
+	RedSea volume(fd);
+	if (!volume.Valid()) {
+		fprintf(stderr, "%s: not a RedSea volume\n", image);
+		return 1;
+	}
+
+	RedSeaCompactor compactor(&volume);
+	compactor.SetThrottle(rate);
+	compactor.SetPosition(position);
+	if (!compactor.Run(budget)) {
+		fprintf(stderr, "%s: %s, resume with -s %llu\n", image,
+			strerror(errno != 0 ? errno : EIO),
+			(unsigned long long)compactor.Position());
+		return 1;
+	}
+
+	printf("moved %llu KiB\n",
+		(unsigned long long)compactor.MovedBytes() / 1024);
+	if (!compactor.IsDone()) {
+		printf("stopped at %.0f%%, resume with -s %llu\n",
+			compactor.Progress() * 100,
+			(unsigned long long)compactor.Position());
+	}
+	return 0;
+}
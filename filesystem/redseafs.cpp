@@ -6,9 +6,13 @@
 
 // #include <ObjectList.h>
 
+#include <errno.h>
 #include <syslog.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "compactor.h"
 #include "redsea.h"
 
 #define SHOULD_LOG 0
@@ -32,8 +36,10 @@ void TRACE_DIR(fs_volume *volume, RedSeaDirectory *dir)
 	TRACE("Directory '%s' (%llu):\n", dir->Name(), dir->DirEntry().mCluster);
 	trace_indent++;
 	RedSea *rs = (RedSea *)volume->private_volume;
-	for (int i = 0; i < dir->CountEntries(); i++) {
-		RedSeaDirEntry *entry = rs->Create(dir->GetEntry(i));
+	int slot = 0;
+	RSEntryPointer pointer;
+	while ((pointer = dir->NextEntry(&slot)).mLocation != gInvalidPointer.mLocation) {
+		RedSeaDirEntry *entry = rs->Create(pointer);
 		if (entry->IsFile()) {
 			TRACE("File '%s' (%llu) -> %llu bytes\n", entry->Name(), entry->DirEntry().mCluster, entry->DirEntry().mSize);
 		} else {
@@ -83,19 +89,14 @@ RedSeaDirEntry *entry_for_name(fs_volume *volume, RedSeaDirectory *directory, co
 	if (strcmp(".", name) == 0)
 		return dirent_for_ino(volume, directory->DirEntry().mCluster);
 	
-	for (int i = 0; i < directory->CountEntries(); i++)
-	{
-		RedSeaDirEntry *entry = dirent_for_pointer(volume, directory->GetEntry(i));
-		if (strcmp(entry->Name(), name) == 0) {
-			TRACE_EXIT;
-			return entry;
-		}
-
-		release_dirent(volume, entry);
+	RSEntryPointer pointer = directory->Lookup(name);
+	if (pointer.mLocation == gInvalidPointer.mLocation) {
+		TRACE_EXIT;
+		return NULL;
 	}
-	
+
 	TRACE_EXIT;
-	return NULL;
+	return dirent_for_pointer(volume, pointer);
 }
 
 static status_t
@@ -166,17 +167,16 @@ status_t redsea_unlink(fs_volume *volume, fs_vnode *v_dir, const char *name)
 
 	RedSeaDirectory *dir = (RedSeaDirectory *)v_dir->private_node;
 
-	dir->LockRead();
 	dir->LockWrite();
 	
 	RedSeaDirEntry *entry = entry_for_name(volume, dir, name);
 
 	if (entry == NULL) {
+		dir->UnlockWrite();
 		TRACE_EXIT;
 		return B_ERROR;
 	}
 
-	entry->LockRead();
 	entry->LockWrite();
 
 	entry->Delete();
@@ -184,9 +184,9 @@ status_t redsea_unlink(fs_volume *volume, fs_vnode *v_dir, const char *name)
 
 	release_dirent(volume, entry);
 	remove_vnode(volume, entry->DirEntry().mCluster);
+	entry->UnlockWrite();
 	delete entry;
 	
-	dir->UnlockRead();
 	dir->UnlockWrite();
 	TRACE_EXIT;
 
@@ -194,6 +194,30 @@ status_t redsea_unlink(fs_volume *volume, fs_vnode *v_dir, const char *name)
 }
 
 
+// Locks both directories of a rename, always in the same order.
+static void
+lock_directories(RedSeaDirectory *a, RedSeaDirectory *b)
+{
+	if (b < a) {
+		RedSeaDirectory *swap = a;
+		a = b;
+		b = swap;
+	}
+	a->LockWrite();
+	if (b != a)
+		b->LockWrite();
+}
+
+
+static void
+unlock_directories(RedSeaDirectory *a, RedSeaDirectory *b)
+{
+	a->UnlockWrite();
+	if (b != a)
+		b->UnlockWrite();
+}
+
+
 status_t redsea_rename(fs_volume *volume, fs_vnode *dir, const char *fromName,
 	fs_vnode *todir, const char *toName)
 {
@@ -205,12 +229,15 @@ status_t redsea_rename(fs_volume *volume, fs_vnode *dir, const char *fromName,
 	TRACE_DIR(volume, from);
 	TRACE_DIR(volume, to);
 	
-	from->LockWrite();
-	to->LockWrite();
+	lock_directories(from, to);
 	
 	RedSeaDirEntry *fromnode = entry_for_name(volume, from, fromName);
+	if (fromnode == NULL) {
+		unlock_directories(from, to);
+		TRACE_EXIT;
+		return B_ENTRY_NOT_FOUND;
+	}
 	
-	fromnode->LockRead();
 	fromnode->LockWrite();
 	
 	ino_t old_ino = ino_for_dirent(volume, fromnode);
@@ -220,9 +247,9 @@ status_t redsea_rename(fs_volume *volume, fs_vnode *dir, const char *fromName,
 		from->RemoveEntry(fromnode);
 		to->AddEntry(fromnode);
 	} else {
-		if (!to->AddEntry(fromnode)) {
-			fromnode->UnlockRead();
+		if (to->AddEntry(fromnode) < 0) {
 			fromnode->UnlockWrite();
+			unlock_directories(from, to);
 			TRACE_EXIT;
 			return B_ERROR;
 		}
@@ -234,8 +261,8 @@ status_t redsea_rename(fs_volume *volume, fs_vnode *dir, const char *fromName,
 	enter_dirent(volume, fromnode);
 	release_dirent(volume, fromnode);
 
-	fromnode->UnlockRead();
 	fromnode->UnlockWrite();
+	unlock_directories(from, to);
 
 	TRACE_DIR(volume, from);
 	TRACE_DIR(volume, to);
@@ -272,8 +299,35 @@ status_t redsea_read_stat(fs_volume *volume, fs_vnode *vnode,
 }
 
 
+// The volume does not report write errors itself; they end up in the
+// syslog from here.
+static status_t
+sync_volume(RedSea *rs)
+{
+	errno = 0;
+	if (rs->Sync())
+		return B_OK;
+	syslog(LOG_ERR, "RS: writing back the volume failed: %s\n",
+		strerror(errno != 0 ? errno : B_IO_ERROR));
+	return B_IO_ERROR;
+}
+
+
+status_t redsea_sync(fs_volume *volume)
+{
+	TRACE_ENTER;
+	status_t status = sync_volume((RedSea *)volume->private_volume);
+	TRACE_EXIT;
+	return status;
+}
+
+
 status_t redsea_unmount(fs_volume *volume)
 {
+	RedSea *rs = (RedSea *)volume->private_volume;
+	status_t status = sync_volume(rs);
+	delete rs;
+
 	/*
 	RedSea *rs = (RedSea *)volume->private_volume;
 	BObjectList<RedSeaDirEntry> entries;
@@ -303,7 +357,7 @@ status_t redsea_unmount(fs_volume *volume)
 		i--;
 	}*/
 	
-	return B_OK;
+	return status;
 }
 
 status_t redsea_write_stat(fs_volume *volume, fs_vnode *vnode,
@@ -312,13 +366,11 @@ status_t redsea_write_stat(fs_volume *volume, fs_vnode *vnode,
 	TRACE_ENTER;
 	RedSeaDirEntry *entry = (RedSeaDirEntry *)vnode->private_node;
 	entry->LockWrite();
-	entry->LockRead();
 
 	if (statmask & B_STAT_SIZE_INSECURE) {
 		uint64_t origsize = entry->DirEntry().mSize;
 		if (!entry->Resize(stat->st_size)) {
 			entry->UnlockWrite();
-			entry->UnlockRead();
 			TRACE_EXIT;
 			return B_ERROR;
 		}
@@ -328,7 +380,6 @@ status_t redsea_write_stat(fs_volume *volume, fs_vnode *vnode,
 	}
 
 	entry->UnlockWrite();
-	entry->UnlockRead();
 	
 	TRACE_EXIT;
 	return B_OK;
@@ -338,6 +389,7 @@ status_t redsea_write_stat(fs_volume *volume, fs_vnode *vnode,
 struct FileCookie {
 	RedSeaFile *file;
 	int openmode;
+	RSReadAhead readAhead;
 };
 
 
@@ -357,12 +409,14 @@ status_t redsea_create(fs_volume *volume, fs_vnode *dir, const char *name,
 
 	*newVnodeId = ino_for_pointer(volume, p);
 
-	*cookie = malloc(sizeof(FileCookie));
+	*cookie = new FileCookie();
 	FileCookie *c = (FileCookie *)*cookie;
 
 	c->openmode = openmode & O_ACCMODE;
 	
 	c->file = (RedSeaFile *)dirent_for_pointer(volume, p);
+	// the data is placed once the file is closed
+	c->file->DelayAllocation();
 
 	c->file->Flush();
 	((RedSea *)volume->private_volume)->FlushBitmap();
@@ -381,7 +435,7 @@ status_t redsea_open(fs_volume *volume, fs_vnode *vnode, int openmode, void **co
 {
 	TRACE_ENTER;
 
-	*cookie = malloc(sizeof(FileCookie));
+	*cookie = new FileCookie();
 	FileCookie *c = (FileCookie *)*cookie;
 
 	c->openmode = openmode & O_ACCMODE;
@@ -400,11 +454,49 @@ status_t redsea_close(fs_volume *volume, fs_vnode *vnode, void *cookie)
 {
 	TRACE_ENTER;
 	RedSeaFile *file = (RedSeaFile *)vnode->private_node;
+	FileCookie *c = (FileCookie *)cookie;
+
+	// place delayed data, and give back the room reserved for appends
+	if (c->openmode != O_RDONLY) {
+		file->LockWrite();
+		if (file->IsAllocationDelayed() && file->CommitAllocation())
+			file->Flush();
+		file->TrimReservation();
+		file->UnlockWrite();
+		((RedSea *)volume->private_volume)->FlushBitmap();
+	}
 	TRACE_EXIT;
 	return B_OK;
 }
 
 
+// Places delayed data and writes back everything, together with whatever
+// other callers are syncing at the same time.
+status_t redsea_fsync(fs_volume *volume, fs_vnode *vnode)
+{
+	TRACE_ENTER;
+	RedSeaDirEntry *entry = (RedSeaDirEntry *)vnode->private_node;
+	status_t status = B_OK;
+
+	if (entry->IsFile()) {
+		RedSeaFile *file = (RedSeaFile *)entry;
+		file->LockWrite();
+		if (file->IsAllocationDelayed()) {
+			if (file->CommitAllocation())
+				file->Flush();
+			else if (!file->IsDeleted())
+				status = B_DEVICE_FULL;
+		}
+		file->UnlockWrite();
+	}
+
+	if (sync_volume((RedSea *)volume->private_volume) != B_OK && status == B_OK)
+		status = B_IO_ERROR;
+	TRACE_EXIT;
+	return status;
+}
+
+
 status_t redsea_free_cookie(fs_volume *volume, fs_vnode *vnode, void *cookie)
 {
 	TRACE_ENTER;
@@ -427,6 +519,8 @@ status_t redsea_read(fs_volume *volume, fs_vnode *vnode, void *cookie,
 
 	f->LockRead();
 	*length = f->Read(pos, *length, buffer);
+	if (*length != UINT64_MAX)
+		f->ReadAhead(c->readAhead, pos, *length);
 	f->UnlockRead();
 
 	TRACE_EXIT;
@@ -447,25 +541,28 @@ status_t redsea_write(fs_volume *volume, fs_vnode *vnode, void *cookie,
 	if (c->openmode == O_RDONLY)
 		return B_DONT_DO_THAT;
 	
-	f->LockRead();
+	// Growing relocates the data at worst, so readers have to be kept out
+	// for the whole write either way.
+	f->LockWrite();
 	if (pos + *length > f->DirEntry().mSize) {
 		if (!f->Resize(pos + *length)) {
-			f->UnlockRead();
+			f->UnlockWrite();
 			TRACE_EXIT;
 			return B_ERROR;
-		} else {
-			f->LockWrite();
-			f->Flush();
-			RedSea *rs = (RedSea *)volume->private_volume;
-			rs->FlushBitmap();
 		}
-	} else {
-		f->LockWrite();
+		f->Flush();
+		RedSea *rs = (RedSea *)volume->private_volume;
+		rs->FlushBitmap();
 	}
-
-	f->UnlockRead();
 	
+	size_t requested = *length;
+	errno = 0;
 	*length = f->Write(pos, *length, buffer);
+	if (*length < requested) {
+		syslog(LOG_ERR, "RS: write at %lld of '%s' failed: %s\n",
+			(long long)pos + *length, f->Name(),
+			strerror(errno != 0 ? errno : B_IO_ERROR));
+	}
 
 	f->UnlockWrite();
 
@@ -490,6 +587,7 @@ status_t redsea_create_dir(fs_volume *volume, fs_vnode *parent, const char *name
 	
 	RSEntryPointer p = dir->CreateDirectory(name, 0x400 / 64);
 	if (p.mLocation == gInvalidPointer.mLocation) {
+		dir->UnlockWrite();
 		TRACE_EXIT;
 		return B_ERROR;
 	}
@@ -516,20 +614,28 @@ status_t redsea_remove_dir(fs_volume *volume, fs_vnode *parent, const char *name
 	RedSeaDirectory *dir = (RedSeaDirectory *)parent->private_node;
 	TRACE_DIR(volume, dir);
 	RedSea *rs = (RedSea *)volume->private_volume;	
+	dir->LockWrite();
 	RedSeaDirectory *d = (RedSeaDirectory *)entry_for_name(volume, dir, name);
-	d->LockRead();
+	if (d == NULL) {
+		dir->UnlockWrite();
+		TRACE_EXIT;
+		return B_ENTRY_NOT_FOUND;
+	}
 	d->LockWrite();
 	d->Delete();
 	d->Flush();
 	remove_vnode(volume, d->DirEntry().mCluster);
+	d->UnlockWrite();
 	delete d;
+	dir->UnlockWrite();
 	TRACE_DIR(volume, dir);
 	
 	TRACE_EXIT;
+	return B_OK;
 }
 
 struct DirCookie {
-	int index;
+	int slot; // physical slot to continue from
 };
 
 
@@ -543,7 +649,7 @@ status_t redsea_open_dir(fs_volume *volume, fs_vnode *vnode, void **cookie) {
 	}
 
 	DirCookie *c = (DirCookie *)malloc(sizeof(DirCookie));
-	c->index = 0;
+	c->slot = 0;
 	*cookie = c;
 	
 	TRACE_EXIT;
@@ -574,42 +680,56 @@ status_t redsea_read_dir(fs_volume *volume, fs_vnode *vnode, void *cookie,
 	TRACE_ENTER;
 	RedSeaDirectory *dir = (RedSeaDirectory *)vnode->private_node;
 	DirCookie *dircookie = (DirCookie *)cookie;
+	uint32 maxCount = *num;
+	uint32 count = 0;
+	size_t used = 0;
 	
 	dir->LockRead();
 	
-	if (dircookie->index >= dir->CountEntries()) {
-		dir->UnlockRead();
-		*num = 0;
-		TRACE_EXIT;
-		return B_OK;
-	}
-	
-	RedSeaDirEntry *entry = dirent_for_pointer(volume, dir->GetEntry(dircookie->index++));
-	entry->LockRead();
+	// Entries are taken straight from the directory's loaded slots, so no
+	// vnodes need to be instantiated just to list them.
+	int slot = dircookie->slot;
+	while (count < maxCount) {
+		int next = slot;
+		RSEntryPointer pointer = dir->NextEntry(&next);
+		if (pointer.mLocation == gInvalidPointer.mLocation) {
+			slot = next;
+			break;
+		}
 
-	buffer->d_dev = volume->id;
-	buffer->d_ino = ino_for_dirent(volume, entry);
+		RSDirEntry entry;
+		dir->EntryAt(pointer.mLocation, &entry);
+		size_t namelength = strnlen(entry.mName, sizeof(entry.mName));
+		size_t reclen = offsetof(struct dirent, d_name) + namelength + 1;
+		reclen = (reclen + 7) & ~(size_t)7;
+
+		if (used + reclen > buffersize) {
+			if (count == 0) {
+				dir->UnlockRead();
+				TRACE_EXIT;
+				return B_BUFFER_OVERFLOW;
+			}
+			break;
+		}
 
-	size_t namesize = buffersize - sizeof(struct dirent) - 1;
-	int namelength = strlen(entry->Name());
-	buffer->d_reclen = sizeof(struct dirent) - 1 +
-		(namesize > namelength ? namelength : namesize);
-	
-	if (namelength > namesize) {
-		release_dirent(volume, entry);
-		entry->UnlockRead();
-		dir->UnlockRead();
-		TRACE_EXIT;
-		return B_BUFFER_OVERFLOW;
+		struct dirent *dirent = (struct dirent *)((uint8_t *)buffer + used);
+		dirent->d_dev = volume->id;
+		dirent->d_pdev = volume->id;
+		dirent->d_ino = entry.mCluster;
+		dirent->d_pino = dir->DirEntry().mCluster;
+		dirent->d_reclen = reclen;
+		memcpy(dirent->d_name, entry.mName, namelength);
+		dirent->d_name[namelength] = '\0';
+
+		used += reclen;
+		count++;
+		slot = next;
 	}
-	
-	strcpy(buffer->d_name, entry->Name());
 
-	entry->UnlockRead();
+	dircookie->slot = slot;
 	dir->UnlockRead();
-	TRACE_REF_MOVE(entry->DirEntry().mCluster, "read_dir return value");
 
-	*num = 1;
+	*num = count;
 	TRACE_EXIT;
 	return B_OK;
 }
@@ -620,7 +740,7 @@ status_t redsea_rewind_dir(fs_volume *volume, fs_vnode *vnode, void *cookie)
 	TRACE_ENTER;
 	RedSeaDirectory *dir = (RedSeaDirectory *)vnode->private_node;
 	DirCookie *dircookie = (DirCookie *)cookie;
-	dircookie->index = 0;
+	dircookie->slot = 0;
 	
 	TRACE_EXIT;
 	return B_OK;
@@ -648,7 +768,7 @@ fs_vnode_ops gRedSeaFSVnodeOps = {
 	NULL, // set_flags,
 	NULL,   // NULL, // select,
 	NULL,   // NULL, // deselect,
-	NULL, // fsync,
+	redsea_fsync, // fsync,
 
 	NULL, // read_symlink,
 	NULL, // create_symlink,
@@ -802,7 +922,7 @@ fs_volume_ops gRedSeaFSVolumeOps = {
 	redsea_unmount, // unmount,
 	redsea_read_fs_info, // read_fs_info
 	NULL, // write_fs_info
-	NULL, // sync
+	redsea_sync, // sync
 	NULL, // read_vnode,
 
 	/* index directory & index operations */
@@ -827,7 +947,104 @@ fs_volume_ops gRedSeaFSVolumeOps = {
 uint32 redsea_get_supported_operations(partition_data *data, uint32 mask)
 {
 	TRACE_EXIT;
-	return B_DISK_SYSTEM_SUPPORTS_WRITING;
+	return B_DISK_SYSTEM_SUPPORTS_WRITING
+		| B_DISK_SYSTEM_SUPPORTS_DEFRAGMENTING;
+}
+
+
+// Bytes moved between two progress reports while defragmenting.
+#define RS_DEFRAGMENT_STEP	(16 * 1024 * 1024)
+// Copy rate of a defragment job, so that it does not keep the device to
+// itself. The hook takes no parameters, so unlike with redseacompact it
+// cannot be chosen per job.
+#define RS_DEFRAGMENT_RATE	(32 * 1024 * 1024)
+
+// Packs files and directories towards the start of the unmounted volume, so
+// that large contiguous allocations fit again. There is nowhere to keep a
+// resume position between jobs, so a job runs through to the end; one that
+// is interrupted is simply started again, and gives back the space of the
+// move it was in the middle of.
+status_t redsea_defragment(int fd, partition_id partition, disk_job_id job)
+{
+	TRACE_ENTER;
+	// the volume closes its descriptor when done, this one is not ours
+	int volumeFD = dup(fd);
+	if (volumeFD < 0) {
+		TRACE_EXIT;
+		return B_ERROR;
+	}
+
+	RedSea rs(volumeFD);
+	if (!rs.Valid()) {
+		TRACE_EXIT;
+		return B_BAD_VALUE;
+	}
+
+	RedSeaCompactor compactor(&rs);
+	compactor.SetThrottle(RS_DEFRAGMENT_RATE);
+	update_disk_device_job_progress(job, 0.0);
+	while (!compactor.IsDone()) {
+		if (!compactor.Run(RS_DEFRAGMENT_STEP)) {
+			TRACE_EXIT;
+			return B_IO_ERROR;
+		}
+		update_disk_device_job_progress(job, compactor.Progress());
+	}
+
+	TRACE_EXIT;
+	return B_OK;
+}
+
+
+// Looks up "name=value" in the comma separated mount argument string and
+// returns where the value starts.
+const char *find_mount_option(const char *args, const char *name)
+{
+	if (args == NULL)
+		return NULL;
+
+	size_t length = strlen(name);
+	const char *option = args;
+	while (*option != '\0') {
+		if (strncmp(option, name, length) == 0 && option[length] == '=')
+			return option + length + 1;
+
+		option = strchr(option, ',');
+		if (option == NULL)
+			break;
+		option++;
+	}
+
+	return NULL;
+}
+
+
+bool mount_option(const char *args, const char *name, uint64_t *value)
+{
+	const char *option = find_mount_option(args, name);
+	if (option == NULL)
+		return false;
+
+	*value = strtoull(option, NULL, 0);
+	return true;
+}
+
+
+// The allocation policy named by the "alloc" option, the default if there
+// is none, or -1 if the name is unknown.
+int mount_allocation_policy(const char *args)
+{
+	const char *option = find_mount_option(args, "alloc");
+	if (option == NULL)
+		return RS_ALLOCATE_BEST_FIT;
+
+	char name[8];
+	size_t length = strcspn(option, ",");
+	if (length >= sizeof(name))
+		return -1;
+	memcpy(name, option, length);
+	name[length] = '\0';
+	return RedSea::AllocationPolicyFor(name);
 }
 
 
@@ -835,9 +1052,26 @@ status_t redsea_mount(fs_volume *volume, const char *device, uint32 flags,
 	const char *args, ino_t *_rootVnodeID)
 {
 	TRACE_ENTER;
-	int fd = open(device, O_RDWR | O_NOCACHE);
+	uint64_t value;
+	bool mapped = mount_option(args, "mmap", &value) && value != 0;
+	int policy = mount_allocation_policy(args);
+	if (policy < 0) {
+		TRACE_EXIT;
+		return B_BAD_VALUE;
+	}
 
-	RedSea *rs = new RedSea(fd);
+	// Mapped images go through the page cache, everything else bypasses it.
+	int fd = open(device, mapped ? O_RDWR : O_RDWR | O_NOCACHE);
+	if (fd < 0) {
+		TRACE_EXIT;
+		return B_ERROR;
+	}
+
+	RedSea *rs;
+	if (mapped)
+		rs = new RedSea(new RedSeaMappedDevice(fd, true));
+	else
+		rs = new RedSea(fd);
 	
 	if (!rs->Valid()) {
 		delete rs;
@@ -845,6 +1079,14 @@ status_t redsea_mount(fs_volume *volume, const char *device, uint32 flags,
 		return B_ERROR;
 	}
 	
+	if (mount_option(args, "max_io", &value))
+		rs->SetMaxTransferSize(value);
+	if (mount_option(args, "cache", &value))
+		rs->SetCacheSize(value);
+	if (mount_option(args, "defer_bitmap", &value))
+		rs->SetDeferBitmapFlush(value != 0);
+	rs->SetAllocationPolicy(policy);
+
 	volume->ops = &gRedSeaFSVolumeOps;
 	volume->private_volume = rs;
 
@@ -868,7 +1110,8 @@ static file_system_module_info sRedSeaModuleInfo = {
 	"redseafs",				// short_name
 	"RedSea File System",	// pretty_name
 	0						// DDM flags
-	| B_DISK_SYSTEM_SUPPORTS_WRITING,
+	| B_DISK_SYSTEM_SUPPORTS_WRITING
+	| B_DISK_SYSTEM_SUPPORTS_DEFRAGMENTING,
 
 	// scanning
 	NULL,	// identify_partition()
@@ -890,7 +1133,7 @@ static file_system_module_info sRedSeaModuleInfo = {
 	NULL,   // shadow_changed
 
 	/* writing */
-	NULL,   // defragment
+	redsea_defragment,	// defragment
 	NULL,   // repair
 	NULL,   // resize
 	NULL,   // move
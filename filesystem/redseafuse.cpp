@@ -0,0 +1,1140 @@
+// Linux frontend: serves a RedSea image through the FUSE low-level API.
+//
+//	redseafuse [-o max_io=N,cache=N,sync_bitmap,mmap,uring=N,nosplice,alloc=P]
+//		<image> <mountpoint>
+
+#define FUSE_USE_VERSION 34
+
+#include <fuse_lowlevel.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <unordered_map>
+
+#include "redsea.h"
+
+#ifndef FUSE_UNKNOWN_INO
+#define FUSE_UNKNOWN_INO	0xFFFFFFFF
+#endif
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE	(1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE		(1 << 1)
+#endif
+
+// Nothing but this process changes the image while it is mounted, so the
+// kernel may hold on to names and attributes.
+#define RS_FUSE_TIMEOUT		1.0
+#define RS_FUSE_NAME_MAX	37
+
+// A node the kernel knows about. Nodes stay around while the kernel holds
+// lookups on them or while one of their children does, as a child's entry
+// points to its parent's directory object.
+struct FuseNode {
+	RedSeaDirEntry *	entry;
+	fuse_ino_t			ino;
+	uint64_t			lookups;
+	uint64_t			children;
+	FuseNode *			parent;
+	uint64_t			location; // directory slot; UINT64_MAX once removed
+};
+
+struct RedSeaFuse {
+	RedSea *			volume;
+	bool				splice;
+	// guards the node tables and the contents of every directory; file
+	// data is only protected by the per node locks
+	std::mutex			lock;
+	std::unordered_map<fuse_ino_t, FuseNode *> nodes;
+	std::unordered_map<uint64_t, FuseNode *> locations;
+	fuse_ino_t			nextIno;
+};
+
+
+static inline RedSeaFuse *
+fs_for_request(fuse_req_t req)
+{
+	return (RedSeaFuse *)fuse_req_userdata(req);
+}
+
+
+// The following helpers must be called with fs->lock held.
+
+static FuseNode *
+node_for_ino(RedSeaFuse *fs, fuse_ino_t ino)
+{
+	std::unordered_map<fuse_ino_t, FuseNode *>::iterator found
+		= fs->nodes.find(ino);
+	return found == fs->nodes.end() ? NULL : found->second;
+}
+
+
+static RedSeaDirectory *
+directory_for_ino(RedSeaFuse *fs, fuse_ino_t ino, FuseNode **_node = NULL)
+{
+	FuseNode *node = node_for_ino(fs, ino);
+	if (node == NULL || !node->entry->IsDirectory())
+		return NULL;
+	if (_node != NULL)
+		*_node = node;
+	return (RedSeaDirectory *)node->entry;
+}
+
+
+static FuseNode *
+node_for_pointer(RedSeaFuse *fs, FuseNode *parent, RSEntryPointer pointer)
+{
+	std::unordered_map<uint64_t, FuseNode *>::iterator found
+		= fs->locations.find(pointer.mLocation);
+	if (found != fs->locations.end())
+		return found->second;
+
+	FuseNode *node = new FuseNode;
+	node->entry = fs->volume->Create(pointer);
+	node->ino = fs->nextIno++;
+	node->lookups = 0;
+	node->children = 0;
+	node->parent = parent;
+	node->location = pointer.mLocation;
+	if (parent != NULL)
+		parent->children++;
+
+	fs->nodes[node->ino] = node;
+	fs->locations[node->location] = node;
+	return node;
+}
+
+
+// Gives a file whose allocation was delayed its extent; the entry changes,
+// so its directory has to be around still.
+static bool
+commit_entry(RedSeaDirEntry *entry)
+{
+	if (!entry->IsFile())
+		return true;
+
+	RedSeaFile *file = (RedSeaFile *)entry;
+	bool success = true;
+	file->LockWrite();
+	if (file->IsAllocationDelayed() && !file->IsDetached()) {
+		success = file->CommitAllocation();
+		if (success)
+			file->Flush();
+	}
+	file->UnlockWrite();
+	return success;
+}
+
+
+// Frees "node", and then its parents, once nothing refers to them anymore.
+static void
+release_node(RedSeaFuse *fs, FuseNode *node)
+{
+	while (node != NULL && node->lookups == 0 && node->children == 0
+		&& node->ino != FUSE_ROOT_ID) {
+		FuseNode *parent = node->parent;
+		fs->nodes.erase(node->ino);
+		if (node->location != UINT64_MAX) {
+			fs->locations.erase(node->location);
+			commit_entry(node->entry);
+		} else {
+			// removed while in use, nothing refers to the data anymore
+			node->entry->Delete();
+			fs->volume->FlushBitmap();
+		}
+		delete node->entry;
+		delete node;
+
+		if (parent != NULL)
+			parent->children--;
+		node = parent;
+	}
+}
+
+
+static void
+fill_stat(FuseNode *node, struct stat *st)
+{
+	RSDirEntry &entry = node->entry->DirEntry();
+
+	memset(st, 0, sizeof(*st));
+	st->st_ino = node->ino;
+	st->st_mode = node->entry->IsDirectory()
+		? S_IFDIR | ACCESSPERMS : S_IFREG | DEFFILEMODE;
+	st->st_nlink = 1;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_size = entry.mSize;
+	st->st_blksize = 0x200;
+	st->st_blocks = (st->st_size + 0x1FF) / 0x200;
+}
+
+
+static void
+fill_entry_param(FuseNode *node, struct fuse_entry_param *param)
+{
+	memset(param, 0, sizeof(*param));
+	param->ino = node->ino;
+	param->attr_timeout = RS_FUSE_TIMEOUT;
+	param->entry_timeout = RS_FUSE_TIMEOUT;
+	fill_stat(node, &param->attr);
+}
+
+
+static bool
+directory_is_empty(RedSeaDirectory *directory)
+{
+	int slot = 0;
+	RSEntryPointer pointer;
+	while ((pointer = directory->NextEntry(&slot)).mLocation
+			!= gInvalidPointer.mLocation) {
+		RSDirEntry entry;
+		directory->EntryAt(pointer.mLocation, &entry);
+		if (strncmp(entry.mName, "..", sizeof(entry.mName)) != 0)
+			return false;
+	}
+	return true;
+}
+
+
+// Deletes "name" from "directory"; returns an errno value.
+static int
+remove_name(RedSeaFuse *fs, RedSeaDirectory *directory, const char *name,
+	bool isDirectory)
+{
+	RSEntryPointer pointer = directory->Lookup(name);
+	if (pointer.mLocation == gInvalidPointer.mLocation)
+		return ENOENT;
+
+	FuseNode *node = NULL;
+	std::unordered_map<uint64_t, FuseNode *>::iterator found
+		= fs->locations.find(pointer.mLocation);
+	if (found != fs->locations.end())
+		node = found->second;
+
+	RedSeaDirEntry *entry = node != NULL
+		? node->entry : fs->volume->Create(pointer);
+
+	int status = 0;
+	if (entry->IsDirectory() != isDirectory)
+		status = isDirectory ? ENOTDIR : EISDIR;
+	else if (isDirectory && !directory_is_empty((RedSeaDirectory *)entry))
+		status = ENOTEMPTY;
+
+	if (status == 0) {
+		// A node the kernel knows may still be open and written to, so
+		// only its slot goes now; its extent is freed with the node.
+		entry->LockWrite();
+		if (node != NULL)
+			entry->Detach();
+		else {
+			entry->Delete();
+			entry->Flush();
+		}
+		entry->UnlockWrite();
+		fs->volume->FlushBitmap();
+	}
+
+	if (node == NULL)
+		delete entry;
+	else if (status == 0) {
+		// the slot may be reused while the kernel still knows the node
+		fs->locations.erase(node->location);
+		node->location = UINT64_MAX;
+	}
+	return status;
+}
+
+
+// Resizes a file on behalf of a truncate or an extending write; must be
+// called with fs->lock held.
+static bool
+resize_file(RedSeaFuse *fs, RedSeaDirEntry *entry, uint64_t size)
+{
+	entry->LockWrite();
+	bool success = entry->Resize(size);
+	if (success) {
+		entry->Flush();
+		fs->volume->FlushBitmap();
+	}
+	entry->UnlockWrite();
+	return success;
+}
+
+
+// #pragma mark - Operations
+
+
+static void
+redsea_fuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+	RedSeaFuse *fs = (RedSeaFuse *)userdata;
+
+	// read replies are spliced from the image into the FUSE device
+	if (fs->splice && (conn->capable & FUSE_CAP_SPLICE_WRITE)) {
+		conn->want |= FUSE_CAP_SPLICE_WRITE
+			| (conn->capable & FUSE_CAP_SPLICE_MOVE);
+	}
+}
+
+
+// The volume does not report write errors itself; they end up in the log
+// from here.
+static bool
+sync_volume(RedSeaFuse *fs)
+{
+	errno = 0;
+	if (fs->volume->Sync())
+		return true;
+	fuse_log(FUSE_LOG_ERR, "redseafuse: writing back the volume failed: %s\n",
+		strerror(errno != 0 ? errno : EIO));
+	return false;
+}
+
+
+static void
+redsea_fuse_destroy(void *userdata)
+{
+	sync_volume((RedSeaFuse *)userdata);
+}
+
+
+static void
+redsea_fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+	struct fuse_entry_param param;
+
+	if (strlen(name) > RS_FUSE_NAME_MAX) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+
+	fs->lock.lock();
+	FuseNode *dirNode;
+	RedSeaDirectory *dir = directory_for_ino(fs, parent, &dirNode);
+	if (dir == NULL) {
+		fs->lock.unlock();
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	RSEntryPointer pointer = dir->Lookup(name);
+	if (pointer.mLocation == gInvalidPointer.mLocation) {
+		fs->lock.unlock();
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	FuseNode *node = node_for_pointer(fs, dirNode, pointer);
+	node->lookups++;
+	fill_entry_param(node, &param);
+	fs->lock.unlock();
+
+	fuse_reply_entry(req, &param);
+}
+
+
+static void
+redsea_fuse_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+
+	fs->lock.lock();
+	FuseNode *node = node_for_ino(fs, ino);
+	if (node != NULL) {
+		node->lookups -= nlookup < node->lookups ? nlookup : node->lookups;
+		release_node(fs, node);
+	}
+	fs->lock.unlock();
+
+	fuse_reply_none(req);
+}
+
+
+static void
+redsea_fuse_forget_multi(fuse_req_t req, size_t count,
+	struct fuse_forget_data *forgets)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+
+	fs->lock.lock();
+	for (size_t i = 0; i < count; i++) {
+		FuseNode *node = node_for_ino(fs, forgets[i].ino);
+		if (node == NULL)
+			continue;
+		uint64_t nlookup = forgets[i].nlookup;
+		node->lookups -= nlookup < node->lookups ? nlookup : node->lookups;
+		release_node(fs, node);
+	}
+	fs->lock.unlock();
+
+	fuse_reply_none(req);
+}
+
+
+static void
+redsea_fuse_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+	struct stat st;
+
+	fs->lock.lock();
+	FuseNode *node = node_for_ino(fs, ino);
+	if (node == NULL) {
+		fs->lock.unlock();
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	fs->lock.unlock();
+
+	node->entry->LockRead();
+	fill_stat(node, &st);
+	node->entry->UnlockRead();
+
+	fuse_reply_attr(req, &st, RS_FUSE_TIMEOUT);
+}
+
+
+static void
+redsea_fuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+	int to_set, struct fuse_file_info *fi)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+	struct stat st;
+
+	fs->lock.lock();
+	FuseNode *node = node_for_ino(fs, ino);
+	if (node == NULL) {
+		fs->lock.unlock();
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	// sizes are all there is to change
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		if (node->entry->IsDirectory()) {
+			fs->lock.unlock();
+			fuse_reply_err(req, EISDIR);
+			return;
+		}
+		if (!resize_file(fs, node->entry, attr->st_size)) {
+			fs->lock.unlock();
+			fuse_reply_err(req, ENOSPC);
+			return;
+		}
+	}
+	fs->lock.unlock();
+
+	node->entry->LockRead();
+	fill_stat(node, &st);
+	node->entry->UnlockRead();
+
+	fuse_reply_attr(req, &st, RS_FUSE_TIMEOUT);
+}
+
+
+static void
+redsea_fuse_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+	mode_t mode)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+	struct fuse_entry_param param;
+
+	if (strlen(name) > RS_FUSE_NAME_MAX) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+
+	fs->lock.lock();
+	FuseNode *dirNode;
+	RedSeaDirectory *dir = directory_for_ino(fs, parent, &dirNode);
+	if (dir == NULL) {
+		fs->lock.unlock();
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	if (dir->FindEntry(name) >= 0) {
+		fs->lock.unlock();
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+
+	RSEntryPointer pointer = dir->CreateDirectory(name, 0x400 / 64);
+	if (pointer.mLocation == gInvalidPointer.mLocation) {
+		fs->lock.unlock();
+		fuse_reply_err(req, ENOSPC);
+		return;
+	}
+	fs->volume->FlushBitmap();
+
+	FuseNode *node = node_for_pointer(fs, dirNode, pointer);
+	node->lookups++;
+	fill_entry_param(node, &param);
+	fs->lock.unlock();
+
+	fuse_reply_entry(req, &param);
+}
+
+
+static void
+redsea_fuse_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+	mode_t mode, struct fuse_file_info *fi)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+	struct fuse_entry_param param;
+
+	if (strlen(name) > RS_FUSE_NAME_MAX) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+
+	fs->lock.lock();
+	FuseNode *dirNode;
+	RedSeaDirectory *dir = directory_for_ino(fs, parent, &dirNode);
+	if (dir == NULL) {
+		fs->lock.unlock();
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	if (dir->FindEntry(name) >= 0) {
+		fs->lock.unlock();
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+
+	RSEntryPointer pointer = dir->CreateFile(name, 0);
+	if (pointer.mLocation == gInvalidPointer.mLocation) {
+		fs->lock.unlock();
+		fuse_reply_err(req, ENOSPC);
+		return;
+	}
+	fs->volume->FlushBitmap();
+
+	FuseNode *node = node_for_pointer(fs, dirNode, pointer);
+	node->lookups++;
+	// the data is placed once the file is released or synced
+	((RedSeaFile *)node->entry)->DelayAllocation();
+	fill_entry_param(node, &param);
+	fs->lock.unlock();
+
+	fi->fh = (uintptr_t)node;
+	fi->keep_cache = 1;
+	fuse_reply_create(req, &param, fi);
+}
+
+
+static void
+redsea_fuse_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+
+	fs->lock.lock();
+	RedSeaDirectory *dir = directory_for_ino(fs, parent);
+	int status = dir != NULL ? remove_name(fs, dir, name, false) : ENOTDIR;
+	fs->lock.unlock();
+
+	fuse_reply_err(req, status);
+}
+
+
+static void
+redsea_fuse_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+
+	fs->lock.lock();
+	RedSeaDirectory *dir = directory_for_ino(fs, parent);
+	int status = dir != NULL ? remove_name(fs, dir, name, true) : ENOTDIR;
+	fs->lock.unlock();
+
+	fuse_reply_err(req, status);
+}
+
+
+static int
+rename_locked(RedSeaFuse *fs, fuse_ino_t parent, const char *name,
+	fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	FuseNode *fromNode;
+	FuseNode *toNode;
+	RedSeaDirectory *from = directory_for_ino(fs, parent, &fromNode);
+	RedSeaDirectory *to = directory_for_ino(fs, newparent, &toNode);
+	if (from == NULL || to == NULL)
+		return ENOTDIR;
+
+	RSEntryPointer pointer = from->Lookup(name);
+	if (pointer.mLocation == gInvalidPointer.mLocation)
+		return ENOENT;
+
+	RSEntryPointer existing = to->Lookup(newname);
+	if (existing.mLocation == pointer.mLocation)
+		return 0;
+
+	FuseNode *node = node_for_pointer(fs, fromNode, pointer);
+	RedSeaDirEntry *entry = node->entry;
+
+	// a directory cannot move below itself
+	for (FuseNode *ancestor = toNode; ancestor != NULL;
+			ancestor = ancestor->parent) {
+		if (ancestor == node) {
+			release_node(fs, node);
+			return EINVAL;
+		}
+	}
+
+	if (existing.mLocation != gInvalidPointer.mLocation) {
+		int status = (flags & RENAME_NOREPLACE) != 0
+			? EEXIST : remove_name(fs, to, newname, entry->IsDirectory());
+		if (status != 0) {
+			release_node(fs, node);
+			return status;
+		}
+	}
+
+	entry->LockWrite();
+	bool moved = from->MoveEntry(entry, to, newname);
+	entry->UnlockWrite();
+
+	// the entry has a new slot even if it could only be put back
+	fs->locations.erase(node->location);
+	node->location = entry->EntryLocation();
+	fs->locations[node->location] = node;
+
+	if (moved && toNode != fromNode) {
+		fromNode->children--;
+		toNode->children++;
+		node->parent = toNode;
+	}
+
+	release_node(fs, node);
+	return moved ? 0 : ENOSPC;
+}
+
+
+static void
+redsea_fuse_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+	fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+
+	if ((flags & RENAME_EXCHANGE) != 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	if (strlen(newname) > RS_FUSE_NAME_MAX) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+
+	fs->lock.lock();
+	int status = rename_locked(fs, parent, name, newparent, newname, flags);
+	fs->lock.unlock();
+
+	fuse_reply_err(req, status);
+}
+
+
+static void
+redsea_fuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+
+	fs->lock.lock();
+	FuseNode *node = node_for_ino(fs, ino);
+	if (node == NULL) {
+		fs->lock.unlock();
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (node->entry->IsDirectory()) {
+		fs->lock.unlock();
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	if ((fi->flags & O_TRUNC) != 0 && !resize_file(fs, node->entry, 0)) {
+		fs->lock.unlock();
+		fuse_reply_err(req, EIO);
+		return;
+	}
+	fs->lock.unlock();
+
+	fi->fh = (uintptr_t)node;
+	fi->keep_cache = 1;
+	fuse_reply_open(req, fi);
+}
+
+
+static void
+redsea_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	struct fuse_file_info *fi)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+	RedSeaFile *file = (RedSeaFile *)((FuseNode *)fi->fh)->entry;
+
+	// The file is only locked shared, so reads proceed in parallel on the
+	// session's worker threads, even within one file.
+	file->LockRead();
+
+	if (fs->splice) {
+		uint64_t count = size;
+		uint64_t position;
+		int fd = file->MapRead(off, &count, &position);
+		if (fd >= 0) {
+			struct fuse_bufvec data = FUSE_BUFVEC_INIT(count);
+			data.buf[0].flags
+				= (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+			data.buf[0].fd = fd;
+			data.buf[0].pos = position;
+			fuse_reply_data(req, &data, FUSE_BUF_SPLICE_MOVE);
+			file->UnlockRead();
+			return;
+		}
+	}
+
+	char *buffer = (char *)malloc(size);
+	if (buffer == NULL) {
+		file->UnlockRead();
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	uint64_t count = file->Read(off, size, buffer);
+	file->UnlockRead();
+
+	if (count == UINT64_MAX)
+		count = 0; // past the end of the file
+	fuse_reply_buf(req, buffer, count);
+	free(buffer);
+}
+
+
+static void
+redsea_fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+	size_t size, off_t off, struct fuse_file_info *fi)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+	RedSeaFile *file = (RedSeaFile *)((FuseNode *)fi->fh)->entry;
+
+	file->LockWrite();
+	while ((uint64_t)off + size > file->DirEntry().mSize) {
+		// growing changes the parent directory, so redo it in order
+		file->UnlockWrite();
+		fs->lock.lock();
+		bool resized = (uint64_t)off + size <= file->DirEntry().mSize
+			|| resize_file(fs, file, off + size);
+		fs->lock.unlock();
+		if (!resized) {
+			fuse_reply_err(req, ENOSPC);
+			return;
+		}
+		file->LockWrite();
+	}
+
+	errno = 0;
+	uint64_t count = file->Write(off, size, buf);
+	file->UnlockWrite();
+
+	if (count < size) {
+		fuse_log(FUSE_LOG_ERR, "redseafuse: write at %llu of inode %llu "
+			"failed: %s\n", (unsigned long long)off + count,
+			(unsigned long long)ino, strerror(errno != 0 ? errno : EIO));
+	}
+
+	if (count == UINT64_MAX)
+		fuse_reply_err(req, EIO);
+	else
+		fuse_reply_write(req, count);
+}
+
+
+// commit_entry() for the file operations, which do not hold fs->lock
+static bool
+commit_file(RedSeaFuse *fs, RedSeaFile *file)
+{
+	fs->lock.lock();
+	bool success = commit_entry(file);
+	fs->lock.unlock();
+	return success;
+}
+
+
+static void
+redsea_fuse_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+	RedSeaDirEntry *entry = ((FuseNode *)fi->fh)->entry;
+
+	// place delayed data, and give back the room reserved for appends
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		bool success = commit_file(fs, (RedSeaFile *)entry);
+		entry->LockWrite();
+		entry->TrimReservation();
+		entry->UnlockWrite();
+		fs->volume->FlushBitmap();
+		fuse_reply_err(req, success ? 0 : EIO);
+		return;
+	}
+	fuse_reply_err(req, 0);
+}
+
+
+static void
+redsea_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+	struct fuse_file_info *fi)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+	bool success = true;
+	if (fi != NULL && fi->fh != 0 && !((FuseNode *)fi->fh)->entry->IsDirectory())
+		success = commit_file(fs, (RedSeaFile *)((FuseNode *)fi->fh)->entry);
+	fuse_reply_err(req, success && sync_volume(fs) ? 0 : EIO);
+}
+
+
+static void
+redsea_fuse_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+
+	fs->lock.lock();
+	RedSeaDirectory *dir = directory_for_ino(fs, ino);
+	fs->lock.unlock();
+
+	if (dir == NULL)
+		fuse_reply_err(req, ENOTDIR);
+	else
+		fuse_reply_open(req, fi);
+}
+
+
+// The offset handed to the kernel is the slot cursor of the next entry;
+// offset 0 stands for ".", which has no slot of its own.
+static void
+redsea_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	struct fuse_file_info *fi)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+	char *buffer = (char *)malloc(size);
+	if (buffer == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	fs->lock.lock();
+	FuseNode *dirNode;
+	RedSeaDirectory *dir = directory_for_ino(fs, ino, &dirNode);
+	if (dir == NULL) {
+		fs->lock.unlock();
+		free(buffer);
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	size_t used = 0;
+	int slot = off;
+
+	if (slot == 0) {
+		st.st_ino = dirNode->ino;
+		st.st_mode = S_IFDIR;
+		used = fuse_add_direntry(req, buffer, size, ".", &st, 1);
+		if (used > size)
+			used = 0;
+		else
+			slot = 1;
+	}
+
+	while (slot > 0) {
+		int next = slot;
+		RSEntryPointer pointer = dir->NextEntry(&next);
+		if (pointer.mLocation == gInvalidPointer.mLocation)
+			break;
+
+		RSDirEntry entry;
+		dir->EntryAt(pointer.mLocation, &entry);
+		char name[sizeof(entry.mName) + 1];
+		size_t length = strnlen(entry.mName, sizeof(entry.mName));
+		memcpy(name, entry.mName, length);
+		name[length] = '\0';
+
+		std::unordered_map<uint64_t, FuseNode *>::iterator found
+			= fs->locations.find(pointer.mLocation);
+		st.st_ino = found != fs->locations.end()
+			? found->second->ino : FUSE_UNKNOWN_INO;
+		st.st_mode = (entry.mAttributes & RS_ATTR_DIR) != 0 ? S_IFDIR : S_IFREG;
+
+		size_t entrySize = fuse_add_direntry(req, buffer + used, size - used,
+			name, &st, next);
+		if (entrySize > size - used)
+			break;
+		used += entrySize;
+		slot = next;
+	}
+	fs->lock.unlock();
+
+	fuse_reply_buf(req, buffer, used);
+	free(buffer);
+}
+
+
+static void
+redsea_fuse_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	RedSeaFuse *fs = fs_for_request(req);
+	struct statvfs info;
+
+	memset(&info, 0, sizeof(info));
+	info.f_bsize = 0x200;
+	info.f_frsize = 0x200;
+	info.f_blocks = fs->volume->BootStructure().count;
+	info.f_bfree = info.f_blocks - fs->volume->UsedClusters();
+	info.f_bavail = info.f_bfree;
+	info.f_files = info.f_blocks * 8;
+	info.f_ffree = info.f_bfree * 8;
+	info.f_namemax = RS_FUSE_NAME_MAX;
+
+	fuse_reply_statfs(req, &info);
+}
+
+
+static struct fuse_lowlevel_ops sRedSeaFuseOps;
+
+
+static void
+init_ops(struct fuse_lowlevel_ops *ops)
+{
+	memset(ops, 0, sizeof(*ops));
+	ops->init = redsea_fuse_init;
+	ops->destroy = redsea_fuse_destroy;
+	ops->lookup = redsea_fuse_lookup;
+	ops->forget = redsea_fuse_forget;
+	ops->forget_multi = redsea_fuse_forget_multi;
+	ops->getattr = redsea_fuse_getattr;
+	ops->setattr = redsea_fuse_setattr;
+	ops->mkdir = redsea_fuse_mkdir;
+	ops->create = redsea_fuse_create;
+	ops->unlink = redsea_fuse_unlink;
+	ops->rmdir = redsea_fuse_rmdir;
+	ops->rename = redsea_fuse_rename;
+	ops->open = redsea_fuse_open;
+	ops->read = redsea_fuse_read;
+	ops->write = redsea_fuse_write;
+	ops->release = redsea_fuse_release;
+	ops->fsync = redsea_fuse_fsync;
+	ops->opendir = redsea_fuse_opendir;
+	ops->readdir = redsea_fuse_readdir;
+	ops->fsyncdir = redsea_fuse_fsync;
+	ops->statfs = redsea_fuse_statfs;
+}
+
+
+// #pragma mark - Command line
+
+
+struct RedSeaFuseOptions {
+	char *				image;
+	unsigned long		maxIO;
+	unsigned long		cache;
+	int					deferBitmap;
+	int					noSplice;
+	int					mmap;
+	unsigned long		uring;
+	char *				alloc;
+};
+
+#define RS_OPTION(templ, field, value) \
+	{ templ, offsetof(struct RedSeaFuseOptions, field), value }
+
+static const struct fuse_opt kRedSeaFuseOptions[] = {
+	RS_OPTION("max_io=%lu", maxIO, 0),
+	RS_OPTION("cache=%lu", cache, 0),
+	RS_OPTION("defer_bitmap", deferBitmap, 1), // the default by now
+	RS_OPTION("sync_bitmap", deferBitmap, 0),
+	RS_OPTION("nosplice", noSplice, 1),
+	RS_OPTION("mmap", mmap, 1),
+	RS_OPTION("uring=%lu", uring, 0),
+	RS_OPTION("alloc=%s", alloc, 0),
+	FUSE_OPT_END
+};
+
+
+static int
+parse_option(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+	RedSeaFuseOptions *options = (RedSeaFuseOptions *)data;
+
+	// the first plain argument is the image, the mount point follows
+	if (key == FUSE_OPT_KEY_NONOPT && options->image == NULL) {
+		options->image = strdup(arg);
+		return 0;
+	}
+	return 1;
+}
+
+
+static void
+usage(const char *name)
+{
+	printf("usage: %s [options] <image> <mountpoint>\n\n", name);
+	printf("RedSea options:\n"
+		"    -o max_io=BYTES        largest single device request\n"
+		"    -o cache=BYTES         block cache size, 0 disables it\n"
+		"    -o sync_bitmap         write the bitmap on every change, not on sync\n"
+		"    -o nosplice            copy read data instead of splicing it\n"
+		"    -o mmap                serve the image from a shared mapping\n"
+		"    -o uring=DEPTH         batch large transfers through io_uring\n"
+		"    -o alloc=POLICY        first, best (default), next or near,\n"
+		"                           which keeps files close to their directory\n\n");
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct RedSeaFuseOptions options;
+	struct fuse_cmdline_opts cmdline;
+	int result = 1;
+
+	memset(&options, 0, sizeof(options));
+	options.cache = ULONG_MAX;
+	options.deferBitmap = 1;
+	if (fuse_opt_parse(&args, &options, kRedSeaFuseOptions, parse_option) != 0)
+		return 1;
+	if (fuse_parse_cmdline(&args, &cmdline) != 0)
+		return 1;
+
+	if (cmdline.show_help) {
+		usage(argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		result = 0;
+		goto out;
+	}
+	if (cmdline.show_version) {
+		fuse_lowlevel_version();
+		result = 0;
+		goto out;
+	}
+	if (options.image == NULL || cmdline.mountpoint == NULL) {
+		usage(argv[0]);
+		goto out;
+	}
+	if (options.alloc != NULL
+		&& RedSea::AllocationPolicyFor(options.alloc) < 0) {
+		fprintf(stderr, "%s: unknown allocation policy \"%s\"\n", argv[0],
+			options.alloc);
+		goto out;
+	}
+
+	{
+		// images without write permission are still served, read-only
+		bool writable = true;
+		int fd = open(options.image, O_RDWR);
+		if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+			writable = false;
+			fd = open(options.image, O_RDONLY);
+		}
+		if (fd < 0) {
+			perror(options.image);
+			goto out;
+		}
+
+		RedSeaFuse fs;
+		if (options.mmap)
+			fs.volume = new RedSea(new RedSeaMappedDevice(fd, writable));
+		else if (options.uring != 0) {
+			RedSeaUringDevice *device = new RedSeaUringDevice(fd, 1,
+				options.uring);
+			if (!device->HasRing())
+				fprintf(stderr, "%s: io_uring unavailable, using pread\n",
+					argv[0]);
+			fs.volume = new RedSea(device);
+		} else
+			fs.volume = new RedSea(fd);
+		if (!fs.volume->Valid()) {
+			fprintf(stderr, "%s: not a RedSea volume\n", options.image);
+			delete fs.volume;
+			goto out;
+		}
+
+		if (!writable)
+			fuse_opt_add_arg(&args, "-oro");
+		if (options.maxIO != 0)
+			fs.volume->SetMaxTransferSize(options.maxIO);
+		if (options.cache != ULONG_MAX)
+			fs.volume->SetCacheSize(options.cache);
+		fs.volume->SetDeferBitmapFlush(options.deferBitmap != 0);
+		if (options.alloc != NULL) {
+			fs.volume->SetAllocationPolicy(
+				RedSea::AllocationPolicyFor(options.alloc));
+		}
+		fs.splice = options.noSplice == 0;
+
+		FuseNode *root = new FuseNode;
+		root->entry = fs.volume->Create(fs.volume->RootDirectory());
+		root->ino = FUSE_ROOT_ID;
+		root->lookups = 1;
+		root->children = 0;
+		root->parent = NULL;
+		root->location = fs.volume->RootDirectory().mLocation;
+		fs.nodes[root->ino] = root;
+		fs.locations[root->location] = root;
+		fs.nextIno = FUSE_ROOT_ID + 1;
+
+		init_ops(&sRedSeaFuseOps);
+		struct fuse_session *session = fuse_session_new(&args, &sRedSeaFuseOps,
+			sizeof(sRedSeaFuseOps), &fs);
+		if (session != NULL) {
+			if (fuse_set_signal_handlers(session) == 0) {
+				if (fuse_session_mount(session, cmdline.mountpoint) == 0) {
+					fuse_daemonize(cmdline.foreground);
+					if (cmdline.singlethread)
+						result = fuse_session_loop(session);
+					else {
+						struct fuse_loop_config config;
+						memset(&config, 0, sizeof(config));
+						config.clone_fd = cmdline.clone_fd;
+						config.max_idle_threads = cmdline.max_idle_threads;
+						result = fuse_session_loop_mt(session, &config);
+					}
+					fuse_session_unmount(session);
+				}
+				fuse_remove_signal_handlers(session);
+			}
+			fuse_session_destroy(session);
+		}
+
+		// whatever the kernel did not forget before unmounting; files are
+		// committed while all the directories they are in are still there
+		std::unordered_map<fuse_ino_t, FuseNode *>::iterator node
+			= fs.nodes.begin();
+		for (; node != fs.nodes.end(); node++)
+			commit_entry(node->second->entry);
+		for (node = fs.nodes.begin(); node != fs.nodes.end(); node++) {
+			if (node->second->location == UINT64_MAX)
+				node->second->entry->Delete();
+			delete node->second->entry;
+			delete node->second;
+		}
+		sync_volume(&fs);
+		delete fs.volume;
+	}
+
+out:
+	free(cmdline.mountpoint);
+	free(options.image);
+	free(options.alloc);
+	fuse_opt_free_args(&args);
+	return result != 0 ? 1 : 0;
+}